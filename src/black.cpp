@@ -4,8 +4,10 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <queue>
@@ -13,14 +15,24 @@
 #include <sstream>
 #include <vector>
 
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
+#include "capture.hpp"
+#include "overlay.hpp"
+#include "task_pool.hpp"
+
 using namespace cv;
 using namespace std;
 
 const char*       VIDEO_FILE          = "../data/balance.m4v";
-double            VIDEO_FPS           = 30.293694;
 
 const char*       WINDOW_NAME         = "mainwindow";
 const int         WINDOW_WIDTH        = 1046;
@@ -38,31 +50,46 @@ const Scalar      SELECT_COLOR        = GREEN;
 const unsigned    TEXT_LINE_PITCH     = 16;
 
 const char*       DUMP_FNAME          = "modeldump";
+const unsigned    DEFAULT_RING_DEPTH  = 4;
+
+// The bar watched when none is given with --bar; the beam covers
+// BAR_BEAM_FRACTION of the bar's subdivisions.
+const Rect        DEFAULT_BAR_RECT    = Rect(735, 240, 16, 480);
+const unsigned    DEFAULT_BAR_SUBDIVS = 120;
+const double      BAR_BEAM_FRACTION   = 0.27;
+
+// find_mark: horizontal blur width, gray threshold, and the Huber
+// distance (pixels) and pass count of the robust refit.
+const int         MARK_BLUR_WIDTH     = 50;
+const int         MARK_THRESHOLD      = 100;
+const double      MARK_HUBER_C        = 1.345;
+const unsigned    MARK_HUBER_PASSES   = 3;
 
 enum model_state { UNRESOLVED = 0, VALID = 1 };
 
 typedef Vec<uchar, 3> bgr_t;
 
 struct model_t {
-        int      frame_wait; 
-        uint64_t frame_last_ts_ms;
-
         struct bar_t {
-                const Point roiNW = Point(735, 240), roiWH = Point(16, 480);
-                const uint subdivs = 120;
-                const uint rows_per_subdiv = roiWH.y / subdivs;
-                const uint pix_per_subdiv = rows_per_subdiv * roiWH.x;
-                const uint bar_height = subdivs * 0.27;
-                const Rect rect = Rect(roiNW, roiNW + roiWH);
-                Mat roi;
-                vector<uint64> means = vector<uint64>(subdivs);
-        } bar;
+                Rect     rect;
+                unsigned subdivs;
+                unsigned rows_per_subdiv;
+                unsigned pix_per_subdiv;
+                unsigned bar_height;            // in subdivisions
+                vector<uint64> means;
+                vector<uint64> prefix;          // prefix[i] = sum of means[0..i-1]
+                float    beam;                  // top of the beam, in subdivisions
+        };
+        vector<bar_t> bars;
 
         struct mark_t {
                 const Rect roi;
                 const int threshhold_type;
+                bool robust;                    // Huber reweighted fit
                 Vec4f line;
-                Mat blurred, gray, binary, points, result;
+                unsigned npoints;
+                vector<uchar> mask;             // binary ROI, for reweighting
+                bool found;
                 Point p1, p2;
         }
         mark    = { Rect(Point(445, 425), Point(499, 525)), THRESH_BINARY_INV },
@@ -70,144 +97,633 @@ struct model_t {
 
 } model;
 
-static void find_mark(model_t::mark_t& mark, Mat& scene)
+/**
+ * One detector run per frame: detect only reads the frame and its own
+ * model state, so the detectors can run concurrently; draw records the
+ * overlay after they have all finished.
+ */
+struct detector_t {
+        string name;
+        function<void (const Mat&)> detect;
+        function<void (overlay_t&)> draw;
+
+        uint64_t calls;
+        double   total_ms;
+        double   max_ms;
+};
+
+/**
+ * The original find_mark chain, kept as the reference for --bench-mark.
+ * Returns the number of points fitted.  Its buffers are kept from call to
+ * call, as find_mark kept them in the mark, so the benchmark does not
+ * charge the reference for allocations the original did not make.
+ */
+static unsigned fit_mark_reference(const model_t::mark_t& mark, const Mat& scene, Vec4f& line)
+{
+        static Mat blurred, gray, binary, points;
+
+        blur(scene(mark.roi), blurred, Size(MARK_BLUR_WIDTH, 1), Point(-1, -1), BORDER_REFLECT);
+        cvtColor(blurred, gray, CV_BGR2GRAY);
+        threshold(gray, binary, MARK_THRESHOLD, 255, mark.threshhold_type);
+        findNonZero(binary, points);
+
+        if (points.size().height == 0)
+                return 0;
+
+        fitLine(points, line, CV_DIST_L2, 0, 0.01, 0.01);
+
+        return points.size().height;
+}
+
+/**
+ * BORDER_REFLECT index into a row of n pixels
+ */
+static inline int reflect(int x, int n)
+{
+        return x < 0 ? -x - 1 : x >= n ? 2 * n - x - 1 : x;
+}
+
+/**
+ * Line moments of a set of points, with the fit as fitLine(CV_DIST_L2)
+ * does it: through the centroid, along the major axis of the covariance.
+ */
+struct line_moments_t {
+        double w, x, y, xx, xy, yy;
+
+        void add(double px, double py, double pw)
+        {
+                w  += pw;
+                x  += pw * px;
+                y  += pw * py;
+                xx += pw * px * px;
+                xy += pw * px * py;
+                yy += pw * py * py;
+        }
+
+        bool fit(Vec4f& line) const
+        {
+                if (w <= 0)
+                        return false;
+
+                double mx = x / w, my = y / w;
+                double dxx = xx / w - mx * mx;
+                double dyy = yy / w - my * my;
+                double dxy = xy / w - mx * my;
+                double t = atan2(2 * dxy, dxx - dyy) / 2;
+
+                line = Vec4f(cos(t), sin(t), mx, my);
+
+                return true;
+        }
+};
+
+/**
+ * Fit a line to the pixels of mark.roi that pass the threshold after the
+ * 50x1 horizontal blur and gray conversion, in one pass over the ROI.
+ *
+ * The blur is a running sum per channel: like blur() on a ROI it reads the
+ * frame pixels either side of the ROI and reflects only at the frame edges,
+ * and it rounds the same way, so the mask is exactly the one the original
+ * chain thresholds.  Each passing pixel goes straight into the moment sums.
+ *
+ * With mark.robust the fit is then refined by a few Huber reweighted
+ * passes over the mask, which limits the pull of stray blobs in the ROI.
+ */
+static bool fit_mark(model_t::mark_t& mark, const Mat& scene)
+{
+        const Rect& roi = mark.roi;
+        const int half = MARK_BLUR_WIDTH / 2;
+        const double scale = 1. / MARK_BLUR_WIDTH;
+        const bool inverted = mark.threshhold_type == THRESH_BINARY_INV;
+        line_moments_t m = {};
+
+        mark.mask.resize(roi.area());
+        mark.npoints = 0;
+
+        for (int y = 0; y < roi.height; y++) {
+                const uchar* row = scene.ptr<uchar>(roi.y + y);
+                uchar* mask = &mark.mask[y * roi.width];
+                int sum[3] = {};
+
+                // Window of the first output pixel: [x - half, x + half)
+                for (int k = -half; k < MARK_BLUR_WIDTH - half; k++) {
+                        const uchar* p = row + reflect(roi.x + k, scene.cols) * 3;
+                        sum[0] += p[0];
+                        sum[1] += p[1];
+                        sum[2] += p[2];
+                }
+
+                for (int x = 0; x < roi.width; x++) {
+                        int b = saturate_cast<uchar>(sum[0] * scale);
+                        int g = saturate_cast<uchar>(sum[1] * scale);
+                        int r = saturate_cast<uchar>(sum[2] * scale);
+                        int gray = (b * 1868 + g * 9617 + r * 4899 + (1 << 13)) >> 14;
+
+                        mask[x] = (gray > MARK_THRESHOLD) != inverted;
+
+                        if (mask[x]) {
+                                m.add(x, y, 1);
+                                mark.npoints++;
+                        }
+
+                        const uchar* in  = row + reflect(roi.x + x + MARK_BLUR_WIDTH - half, scene.cols) * 3;
+                        const uchar* out = row + reflect(roi.x + x - half, scene.cols) * 3;
+                        sum[0] += in[0] - out[0];
+                        sum[1] += in[1] - out[1];
+                        sum[2] += in[2] - out[2];
+                }
+        }
+
+        if (!m.fit(mark.line))
+                return false;
+
+        for (unsigned i = 0; mark.robust && i < MARK_HUBER_PASSES; i++) {
+                const Vec4f& l = mark.line;
+                line_moments_t rm = {};
+
+                for (int y = 0; y < roi.height; y++) {
+                        const uchar* mask = &mark.mask[y * roi.width];
+
+                        for (int x = 0; x < roi.width; x++) {
+                                if (!mask[x])
+                                        continue;
+
+                                double d = fabs((x - l[2]) * l[1] - (y - l[3]) * l[0]);
+                                rm.add(x, y, d <= MARK_HUBER_C ? 1 : MARK_HUBER_C / d);
+                        }
+                }
+
+                rm.fit(mark.line);
+        }
+
+        return true;
+}
+
+static void find_mark(model_t::mark_t& mark, const Mat& scene)
 {
         Vec4f& line = mark.line;
 
-        blur(scene(mark.roi), mark.blurred, Size(50, 1), Point(-1, -1), BORDER_REFLECT);
-        cvtColor(mark.blurred, mark.gray, CV_BGR2GRAY);
-        threshold(mark.gray, mark.binary, 100, 255, mark.threshhold_type);
-        findNonZero(mark.binary, mark.points);
+        mark.found = fit_mark(mark, scene);
 
-        if (mark.points.size().height == 0) {
+        if (!mark.found) {
                 return;
         }
 
-        fitLine(mark.points, mark.line, CV_DIST_L2, 0, 0.01, 0.01);
-        mark.result = scene(mark.roi);
         mark.p1 = Point(line[2] + line[0] * 50, line[3] + line[1] * 50);
         mark.p2 = Point(line[2] + line[0] * -50, line[3] + line[1] * -50);
-        cv::line(mark.result, mark.p1, mark.p2, GREEN, 2, CV_AA);
-        mark.result.copyTo(scene(mark.roi));
-        rectangle(scene, mark.roi, RED, 2); 
 }
 
-static void find_beam(model_t& model, Mat& scene)
+static void draw_mark(const model_t::mark_t& mark, overlay_t& overlay)
 {
-        model_t::bar_t& bar = model.bar;
-        bar.roi = scene(bar.rect);
-        uint64 acc;
+        if (!mark.found) {
+                return;
+        }
 
-        auto bgr = bar.roi.begin<bgr_t>();
-        for (uint i = 0; i < bar.subdivs; i++) {
-                acc = 0;
-                for (uint j = 0; j < bar.pix_per_subdiv; j++, bgr++) {
-                        acc += (*bgr)[0] * (*bgr)[1] * (*bgr)[2];
+        // The line is fitted in roi coordinates and kept inside it
+        overlay.line(mark.p1 + mark.roi.tl(), mark.p2 + mark.roi.tl(), GREEN, 2, CV_AA, mark.roi);
+        overlay.rectangle(mark.roi, RED, 2);
+}
+
+/**
+ * Set up a bar of subdivs subdivisions over rect.  Fails when the rect is
+ * too short to give every subdivision a row, or the beam would not fit.
+ */
+static bool init_bar(model_t::bar_t& bar, const Rect& rect, unsigned subdivs)
+{
+        bar.rect = rect;
+        bar.subdivs = subdivs;
+
+        if (subdivs == 0 || rect.width <= 0 || rect.height < (int) subdivs)
+                return false;
+
+        bar.rows_per_subdiv = rect.height / subdivs;
+        bar.pix_per_subdiv = bar.rows_per_subdiv * rect.width;
+        bar.bar_height = subdivs * BAR_BEAM_FRACTION;
+
+        if (bar.bar_height == 0 || bar.bar_height >= subdivs)
+                return false;
+
+        bar.means.assign(subdivs, 0);
+        bar.prefix.assign(subdivs + 1, 0);
+        bar.beam = 0;
+
+        return true;
+}
+
+/**
+ * Parse a --bar argument, "x,y,width,height[,subdivs]".
+ */
+static bool parse_bar(const char* arg, model_t::bar_t& bar)
+{
+        int x, y, w, h, n;
+        unsigned subdivs = DEFAULT_BAR_SUBDIVS;
+        char extra;
+
+        n = sscanf(arg, "%d,%d,%d,%d,%u%c", &x, &y, &w, &h, &subdivs, &extra);
+
+        if (n != 4 && n != 5)
+                return false;
+
+        return init_bar(bar, Rect(x, y, w, h), subdivs);
+}
+
+/**
+ * Sum of b * g * r over a row of n BGR pixels.
+ *
+ * The vector paths widen four pixels per 128 bit lane to 32 bits with one
+ * shuffle per channel and multiply there.  A product is at most 255^3, so
+ * a 32 bit lane holds the sum of 256 of them before it has to be flushed
+ * to the 64 bit total.  Loads are 16 bytes for 12 bytes of pixels, so the
+ * vector loops stop early enough never to read past the row.
+ */
+static uint64 row_product_sum(const uchar* p, int n)
+{
+        uint64 acc = 0;
+        int i = 0;
+
+#if defined(__SSE4_1__)
+        const __m128i shuf_b = _mm_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+        const __m128i shuf_g = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+        const __m128i shuf_r = _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+        uint32_t lanes[8];
+
+#if defined(__AVX2__)
+        const __m256i shuf_b2 = _mm256_setr_m128i(shuf_b, shuf_b);
+        const __m256i shuf_g2 = _mm256_setr_m128i(shuf_g, shuf_g);
+        const __m256i shuf_r2 = _mm256_setr_m128i(shuf_r, shuf_r);
+
+        while (i + 10 <= n) {
+                __m256i sum = _mm256_setzero_si256();
+
+                for (int k = 0; k < 256 && i + 10 <= n; k++, i += 8) {
+                        __m256i v = _mm256_setr_m128i(
+                                _mm_loadu_si128((const __m128i*) (p + i * 3)),
+                                _mm_loadu_si128((const __m128i*) (p + i * 3 + 12)));
+                        __m256i prod = _mm256_mullo_epi32(
+                                _mm256_mullo_epi32(_mm256_shuffle_epi8(v, shuf_b2),
+                                                   _mm256_shuffle_epi8(v, shuf_g2)),
+                                _mm256_shuffle_epi8(v, shuf_r2));
+                        sum = _mm256_add_epi32(sum, prod);
                 }
-                bar.means[i] = acc / bar.pix_per_subdiv;
+
+                _mm256_storeu_si256((__m256i*) lanes, sum);
+                for (int k = 0; k < 8; k++)
+                        acc += lanes[k];
         }
+#endif
+        while (i + 6 <= n) {
+                __m128i sum = _mm_setzero_si128();
+
+                for (int k = 0; k < 256 && i + 6 <= n; k++, i += 4) {
+                        __m128i v = _mm_loadu_si128((const __m128i*) (p + i * 3));
+                        __m128i prod = _mm_mullo_epi32(
+                                _mm_mullo_epi32(_mm_shuffle_epi8(v, shuf_b),
+                                                _mm_shuffle_epi8(v, shuf_g)),
+                                _mm_shuffle_epi8(v, shuf_r));
+                        sum = _mm_add_epi32(sum, prod);
+                }
 
-        acc = 0;
-        for (uint i = 0; i < bar.bar_height; i++) {
-                acc += bar.means[i];
+                _mm_storeu_si128((__m128i*) lanes, sum);
+                for (int k = 0; k < 4; k++)
+                        acc += lanes[k];
         }
+#endif
+        for (; i < n; i++)
+                acc += (uint32_t) p[i * 3] * p[i * 3 + 1] * p[i * 3 + 2];
+
+        return acc;
+}
+
+/**
+ * Find the darkest run of bar_height subdivisions down the bar.  The
+ * subdivision means come from one pass over the rows, every window sum is
+ * a difference of two prefix sums, and the position of the minimum is
+ * refined to a fraction of a subdivision by fitting a parabola through the
+ * window sums either side of it.
+ */
+static void find_beam(model_t::bar_t& bar, const Mat& scene)
+{
+        const Mat roi = scene(bar.rect);
+        const unsigned nwindows = bar.subdivs - bar.bar_height + 1;
+
+        for (unsigned i = 0; i < bar.subdivs; i++) {
+                uint64 acc = 0;
 
-        uint least_idx = 0;
-        uint64 least_val = acc;
+                for (unsigned r = 0; r < bar.rows_per_subdiv; r++)
+                        acc += row_product_sum(roi.ptr<uchar>(i * bar.rows_per_subdiv + r), roi.cols);
 
-        for (uint i = 0; i < bar.subdivs - bar.bar_height; i++) {
-                if (acc < least_val) {
+                bar.means[i] = acc / bar.pix_per_subdiv;
+                bar.prefix[i + 1] = bar.prefix[i] + bar.means[i];
+        }
+
+        const uint64* prefix = &bar.prefix[0];
+        const unsigned h = bar.bar_height;
+        unsigned least_idx = 0;
+        uint64 least_val = prefix[h];
+
+        for (unsigned i = 1; i < nwindows; i++) {
+                uint64 val = prefix[i + h] - prefix[i];
+
+                if (val < least_val) {
                         least_idx = i;
-                        least_val = acc;
+                        least_val = val;
                 }
-                acc -= bar.means[i];
-                acc += bar.means[i + bar.bar_height];
         }
 
-        uint y1 = bar.roiNW.y + bar.rows_per_subdiv * least_idx;
-        uint y2 = y1 + bar.rows_per_subdiv * bar.bar_height;
-        Rect rect(Point(bar.roiNW.x, y1), Point(bar.roiNW.x + bar.roiWH.x, y2));
-        rectangle(scene, rect, RED, CV_FILLED); 
+        float offset = 0;
+
+        if (least_idx > 0 && least_idx + 1 < nwindows) {
+                double left  = prefix[least_idx - 1 + h] - prefix[least_idx - 1];
+                double right = prefix[least_idx + 1 + h] - prefix[least_idx + 1];
+                double mid   = least_val;
+                double curve = left - 2 * mid + right;
+
+                if (curve > 0)
+                        offset = max(-0.5, min(0.5, 0.5 * (left - right) / curve));
+        }
+
+        bar.beam = least_idx + offset;
 }
 
-static void read_frame(VideoCapture& vc, Mat& m)
+static void draw_beam(const model_t::bar_t& bar, overlay_t& overlay)
 {
-        unsigned frame_count, frame_num;
+        int y1 = cvRound(bar.rect.y + bar.rows_per_subdiv * bar.beam);
+        int y2 = y1 + bar.rows_per_subdiv * bar.bar_height;
+        Rect rect(Point(bar.rect.x, y1), Point(bar.rect.x + bar.rect.width, y2));
+        overlay.rectangle(rect, RED, CV_FILLED);
+}
 
-        if (vc.isOpened()) {
-                frame_count = (unsigned) vc.get(CV_CAP_PROP_FRAME_COUNT);
-                frame_num   = (unsigned) vc.get(CV_CAP_PROP_POS_FRAMES);
+static double elapsed_ms(const struct timespec& t0, const struct timespec& t1)
+{
+        return (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+}
 
-                if (frame_num == frame_count)
-                        vc.release();
+static vector<detector_t> make_detectors(model_t& model)
+{
+        vector<detector_t> detectors;
+
+        for (unsigned i = 0; i < model.bars.size(); i++) {
+                model_t::bar_t& bar = model.bars[i];
+                detectors.push_back(detector_t {
+                        "beam " + to_string(i),
+                        [&bar](const Mat& scene) { find_beam(bar, scene); },
+                        [&bar](overlay_t& overlay) { draw_beam(bar, overlay); }
+                });
         }
 
-        if (!vc.isOpened()) {
-                if (!vc.open(VIDEO_FILE)) {
-                        CV_Error_(-1, ("failed to open video: \"%s\"", VIDEO_FILE));
-                        exit(1);
-                }
+        for (model_t::mark_t* mark : { &model.mark, &model.pointer }) {
+                detectors.push_back(detector_t {
+                        mark == &model.mark ? "mark" : "pointer",
+                        [mark](const Mat& scene) { find_mark(*mark, scene); },
+                        [mark](overlay_t& overlay) { draw_mark(*mark, overlay); }
+                });
         }
 
-        vc.read(m);
+        return detectors;
 }
 
-static void compute_interval(model_t& model)
+/**
+ * Run every detector on the frame, spread over the pool, then record their
+ * overlays.  Returns the wall time of the detection, in ms.
+ */
+static double run_detectors(task_pool_t& pool, vector<detector_t>& detectors,
+                const Mat& scene, overlay_t& overlay)
 {
-        struct timespec ts = {};
-        (void) clock_gettime(CLOCK_MONOTONIC, &ts);
-        uint64_t ts_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        struct timespec t0 = {}, t1 = {};
+        task_group_t group;
 
-        if (model.frame_last_ts_ms == 0) {
-                model.frame_last_ts_ms = ts_ms;
-                model.frame_wait = 1;
-                return;
+        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        for (auto& d : detectors) {
+                pool.submit(group, [&d, &scene] {
+                        struct timespec t0 = {}, t1 = {};
+
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+                        d.detect(scene);
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+
+                        double ms = elapsed_ms(t0, t1);
+                        d.calls++;
+                        d.total_ms += ms;
+                        d.max_ms = max(d.max_ms, ms);
+                });
+        }
+
+        pool.wait(group);
+
+        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        overlay.clear();
+        for (auto& d : detectors)
+                d.draw(overlay);
+
+        return elapsed_ms(t0, t1);
+}
+
+static void print_detector_stats(ostream& os, const vector<detector_t>& detectors,
+                unsigned frames, double wall_ms, unsigned threads)
+{
+        double sum_ms = 0;
+
+        os << "detector      mean ms    max ms  (" << frames << " frames, "
+           << threads << " threads)" << endl;
+
+        for (auto& d : detectors) {
+                double mean = d.calls ? d.total_ms / d.calls : 0;
+                sum_ms += mean;
+                os << setw(10) << left << d.name << right << fixed << setprecision(3)
+                   << setw(10) << mean << setw(10) << d.max_ms << endl;
+        }
+
+        os << "sum       " << setw(10) << sum_ms << endl
+           << "per frame " << setw(10) << (frames ? wall_ms / frames : 0) << endl;
+}
+
+/**
+ * Run the original find_mark chain and the fused fit on both marks of
+ * every frame of the input, and report the time per fit and the largest
+ * difference between the two lines.
+ */
+static int run_bench_mark(const char* input, unsigned ring_depth)
+{
+        model_t::mark_t* marks[] = { &model.mark, &model.pointer };
+        capture_t capture(ring_depth, OVERFLOW_BLOCK);
+        frame_t frame;
+        Mat& scene = frame.image;
+
+        double ref_ms = 0, fused_ms = 0, max_angle = 0, max_offset = 0;
+        unsigned fits = 0, point_mismatches = 0;
+
+        if (!capture.open(input, false)) {
+                cerr << "failed to open input: \"" << input << '"' << endl;
+                return 1;
         }
 
-        uint64_t next_frame_ts_ms = model.frame_last_ts_ms + 1000 / VIDEO_FPS;
-        model.frame_wait = next_frame_ts_ms - ts_ms;
+        while (capture.read(frame)) {
+                for (auto mark : marks) {
+                        struct timespec t0 = {}, t1 = {}, t2 = {};
+                        Vec4f ref;
+
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+                        unsigned npoints = fit_mark_reference(*mark, scene, ref);
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+                        bool fitted = fit_mark(*mark, scene);
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t2);
+
+                        ref_ms += elapsed_ms(t0, t1);
+                        fused_ms += elapsed_ms(t1, t2);
+                        fits++;
+
+                        if (npoints != (fitted ? mark->npoints : 0)) {
+                                point_mismatches++;
+                                continue;
+                        }
 
-        if (model.frame_wait < 1)
-                model.frame_wait = 1;
+                        if (!fitted)
+                                continue;
 
-        if (model.frame_wait > 1000 / VIDEO_FPS)
-                model.frame_wait = 1000 / VIDEO_FPS;
+                        const Vec4f& l = mark->line;
+
+                        // Directions may come out with opposite signs
+                        double cross = fabs(l[0] * ref[1] - l[1] * ref[0]);
+                        double offset = fabs((l[2] - ref[2]) * ref[1] - (l[3] - ref[3]) * ref[0]);
+
+                        max_angle = max(max_angle, asin(min(1.0, cross)));
+                        max_offset = max(max_offset, offset);
+                }
+        }
 
-        model.frame_last_ts_ms = ts_ms;
+        capture.close();
+
+        if (fits == 0)
+                return 1;
+
+        cout << fits << " fits" << (model.mark.robust ? " (robust)" : "") << endl
+             << "reference: " << setw(8) << fixed << setprecision(4)
+             << ref_ms / fits << " ms/fit" << endl
+             << "fused:     " << setw(8) << fused_ms / fits << " ms/fit, speedup "
+             << setprecision(2) << (fused_ms > 0 ? ref_ms / fused_ms : 0) << "x" << endl
+             << setprecision(4)
+             << "point count mismatches " << point_mismatches
+             << ", max angle difference " << max_angle * 180 / CV_PI << " deg"
+             << ", max offset " << max_offset << " px" << endl;
+
+        return point_mismatches ? 1 : 0;
 }
 
 int main(int argc, const char** argv)
 {
-        VideoCapture vc;
+        const char* input = NULL;
+        unsigned ring_depth = DEFAULT_RING_DEPTH;
+        overflow_policy overflow = OVERFLOW_BLOCK;
+        bool bench_mark = false;
+        unsigned threads = max(1u, thread::hardware_concurrency());
 
         bool pause = false;
         bool run = true;
         int key;
 
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--ring-depth") && i + 1 < argc) {
+                        ring_depth = atoi(argv[++i]);
+                }
+                else if (!strcmp(argv[i], "--drop-oldest")) {
+                        overflow = OVERFLOW_DROP_OLDEST;
+                }
+                else if (!strcmp(argv[i], "--robust-mark")) {
+                        model.mark.robust = model.pointer.robust = true;
+                }
+                else if (!strcmp(argv[i], "--bench-mark")) {
+                        bench_mark = true;
+                }
+                else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+                        threads = max(1, atoi(argv[++i]));
+                }
+                else if (!strcmp(argv[i], "--bar") && i + 1 < argc) {
+                        model_t::bar_t bar;
+                        if (!parse_bar(argv[++i], bar)) {
+                                cerr << "bad bar: \"" << argv[i] << '"' << endl;
+                                return 1;
+                        }
+                        model.bars.push_back(bar);
+                }
+                else if (argv[i][0] != '-' && input == NULL) {
+                        input = argv[i];
+                }
+                else {
+                        cerr << "usage: " << argv[0]
+                             << " [--ring-depth n] [--drop-oldest]"
+                                " [--bar x,y,width,height[,subdivs]]..." << endl
+                             << "       [--robust-mark] [--bench-mark] [--threads n] [input]" << endl
+                             << endl
+                             << "  input  video file, image directory or pattern, or raw"
+                                " frame file" << endl
+                             << "         (default: " << VIDEO_FILE << ")" << endl;
+                        return 1;
+                }
+        }
+
+        if (input == NULL)
+                input = VIDEO_FILE;
+
+        if (model.bars.empty()) {
+                model.bars.push_back(model_t::bar_t());
+                init_bar(model.bars.back(), DEFAULT_BAR_RECT, DEFAULT_BAR_SUBDIVS);
+        }
+
+        if (bench_mark)
+                return run_bench_mark(input, ring_depth);
+
+        capture_t capture(ring_depth, overflow);
+
+        if (!capture.open(input, true)) {
+                CV_Error_(-1, ("failed to open input: \"%s\"", input));
+                exit(1);
+        }
+
         cout << "\033[2J";
 
         namedWindow(WINDOW_NAME, CV_WINDOW_NORMAL);
         moveWindow(WINDOW_NAME, WINDOW_X_POS, WINDOW_Y_POS);
         resizeWindow(WINDOW_NAME, WINDOW_WIDTH, WINDOW_HEIGHT);
 
-        Mat scene;
+        vector<detector_t> detectors = make_detectors(model);
+        task_pool_t pool(min<size_t>(threads, detectors.size()) - 1);
+        double detect_ms = 0;
+        unsigned frames = 0;
+
+        frame_t frame;
+        Mat& scene = frame.image;
+        overlay_t overlay;
+        frame_pacer_t pacer(capture.fps());
+        int frame_wait = 1;
 
         while (run) {
                 if (!pause) {
-                        read_frame(vc, scene);
-                        find_beam(model, scene);
-                        find_mark(model.mark, scene);
-                        find_mark(model.pointer, scene);
-                        compute_interval(model);
+                        if (!capture.read(frame))
+                                break;
+                        for (auto& bar : model.bars) {
+                                if ((bar.rect & Rect(Point(), scene.size())) != bar.rect) {
+                                        cerr << "bar " << bar.rect << " is outside the "
+                                             << scene.size() << " frame" << endl;
+                                        return 1;
+                                }
+                        }
+                        detect_ms += run_detectors(pool, detectors, scene, overlay);
+                        frames++;
+                        frame_wait = pacer.next();
                 }
 
-                switch (key = waitKey(model.frame_wait)) {
+                switch (key = waitKey(frame_wait)) {
                         case 32: //space
                                 pause = !pause;
                                 break;
                         case 27: //esc
                                 run = false;
                                 break;
+                        case 116: //t
+                                print_detector_stats(cout, detectors, frames, detect_ms, pool.size());
+                                break;
                         default:
                                 if (key != -1)
                                         cout << "key=" << key << endl;
@@ -219,12 +735,16 @@ int main(int argc, const char** argv)
                 }
 
                 if (!pause) {
+                        overlay.composite(scene);
                         imshow(WINDOW_NAME, scene);
+                        overlay.restore(scene);
                         //cout << '.' << flush;
                 }
         }
 
-        vc.release();
+        capture.close();
+
+        print_detector_stats(cerr, detectors, frames, detect_ms, pool.size());
 
         return 0;
 }
@@ -2,46 +2,102 @@
 #include "opencv2/highgui/highgui.hpp"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "incremental_canny.hpp"
+#include "threshold_sweep.hpp"
 
 using namespace cv;
 
 /// Global variables
 
 Mat src, src_gray;
-Mat dst, detected_edges;
+Mat dst;
+
+/// Blur, gradients and non-maximum suppression of src_gray, computed once
+incremental_canny_t canny;
+/// Pixels of src currently copied into dst
+std::vector<int> shown;
 
 int edgeThresh = 1;
 int lowThreshold;
 int const max_lowThreshold = 100;
 int ratio = 3;
-int kernel_size = 3;
 const char* window_name = "Edge Map";
 
 /**
  * @function CannyThreshold
  * @brief Trackbar callback - Canny thresholds input with a ratio 1:3
+ *
+ * Only hysteresis depends on the thresholds; it runs over the cached local
+ * maxima, and only the pixels that were or are edges are written to dst.
  */
 void CannyThreshold(int, void*)
 {
-    /// Reduce noise with a kernel 3x3
-    blur( src_gray, detected_edges, Size(3,3) );
-
-    /// Canny detector
-    Canny( detected_edges, detected_edges, lowThreshold, lowThreshold*ratio, kernel_size );
+    /// Canny detector, aperture 3
+    const std::vector<int>& edges = canny.hysteresis( lowThreshold, lowThreshold*ratio );
 
     /// Using Canny's output as a mask, we display our result
-    dst = Scalar::all(0);
+    const size_t esz = src.elemSize();
 
-    src.copyTo( dst, detected_edges);
+    for( size_t i = 0; i < shown.size(); i++ )
+        memset( dst.data + shown[i] * esz, 0, esz );
+
+    for( size_t i = 0; i < edges.size(); i++ )
+        memcpy( dst.data + edges[i] * esz, src.data + edges[i] * esz, esz );
+
+    shown = edges;
     imshow( window_name, dst );
 }
 
 
+/**
+ * @function sweep
+ * @brief Evaluate every low threshold of the trackbar, print the curve as
+ * CSV and the automatic pick on stderr
+ */
+int sweep( unsigned threads )
+{
+    task_pool_t pool( threads - 1 );
+    std::vector<sweep_point_t> curve;
+
+    sweep_thresholds( canny, 0, max_lowThreshold, ratio, pool, curve );
+    write_sweep_csv( stdout, curve );
+
+    const sweep_point_t& knee = curve[ sweep_knee( curve ) ];
+    fprintf( stderr, "-- Knee: low %d, high %d, %zu contours\n", knee.low, knee.high, knee.contours );
+
+    return 0;
+}
+
 /** @function main */
 int main( int argc, char** argv )
 {
+    bool sweeping = false;
+    unsigned threads = std::max( 1u, std::thread::hardware_concurrency() );
+    int argi = 1;
+
+    for( ; argi < argc - 1; argi++ )
+    {
+        if( !strcmp( argv[argi], "--sweep" ) )
+            sweeping = true;
+        else if( !strcmp( argv[argi], "--threads" ) && argi + 2 < argc )
+            threads = std::max( 1, atoi( argv[++argi] ) );
+        else
+            break;
+    }
+
+    if( argi != argc - 1 )
+    {
+        fprintf( stderr, "usage: %s [--sweep] [--threads n] image\n", argv[0] );
+        return -1;
+    }
+
     /// Load an image
-    src = imread( argv[1] );
+    src = imread( argv[argi] );
 
     if( !src.data )
     {
@@ -50,10 +106,20 @@ int main( int argc, char** argv )
 
     /// Create a matrix of the same type and size as src (for dst)
     dst.create( src.size(), src.type() );
+    dst = Scalar::all(0);
+    CV_Assert( src.isContinuous() && dst.isContinuous() );
 
     /// Convert the image to grayscale
     cvtColor( src, src_gray, CV_BGR2GRAY );
 
+    /// Reduce noise with a kernel 3x3, then the threshold independent
+    /// part of Canny
+    blur( src_gray, src_gray, Size(3,3) );
+    canny.set_image( src_gray );
+
+    if( sweeping )
+        return sweep( threads );
+
     /// Create a window
     namedWindow( window_name, CV_WINDOW_NORMAL );
 
@@ -0,0 +1,366 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "opencv2/core/core.hpp"
+
+#include "frame_source.hpp"
+
+/**
+ * What the producer does when every slot of the ring holds a frame the
+ * consumer has not taken yet.
+ */
+enum overflow_policy {
+        OVERFLOW_BLOCK       = 0,   // wait for the consumer
+        OVERFLOW_DROP_OLDEST = 1    // overwrite the oldest unconsumed frame
+};
+
+/**
+ * Bounded single-producer/single-consumer ring of preallocated slots.
+ *
+ * The producer fills a slot in place (acquire, write, publish).  The
+ * consumer swaps the slot contents with its own object, so for cv::Mat
+ * payloads the pixel buffers are recycled between the two threads and
+ * nothing is copied or allocated in steady state.  A consumed buffer comes
+ * back to the producer on the next consume(), so the consumer must not keep
+ * references into a frame after asking for the next one.
+ *
+ * Every slot carries a state word; the only transitions are
+ *
+ *      FREE -> WRITING -> READY -> READING -> FREE      (normal)
+ *      READY -> WRITING                                 (drop oldest)
+ *
+ * so the producer and consumer never own the same slot at the same time.
+ */
+template <typename T>
+class spsc_ring {
+public:
+        spsc_ring(unsigned nslots, overflow_policy policy)
+                : n(nslots < 2 ? 2 : nslots), policy(policy),
+                  cells(new cell_t[n]), head(0), tail(0), closed(false),
+                  ndropped(0)
+        {
+                for (unsigned i = 0; i < n; i++) {
+                        cells[i].state.store(FREE, std::memory_order_relaxed);
+                        cells[i].seq.store(0, std::memory_order_relaxed);
+                }
+        }
+
+        unsigned size() const { return n; }
+
+        /**
+         * Slot i, for preallocating payloads before the producer starts.
+         */
+        T& slot(unsigned i) { return cells[i % n].value; }
+
+        /**
+         * Producer: return the slot to fill next, or NULL once the ring has
+         * been closed.  Must be followed by publish().
+         */
+        T* acquire()
+        {
+                cell_t& c = cells[head % n];
+                backoff_t backoff;
+
+                for (;;) {
+                        if (closed.load(std::memory_order_acquire))
+                                return NULL;
+
+                        int s = c.state.load(std::memory_order_acquire);
+
+                        if (s == FREE) {
+                                c.state.store(WRITING, std::memory_order_relaxed);
+                                return &c.value;
+                        }
+
+                        // The ring is full and this slot holds the oldest
+                        // frame; take it back unless the consumer got there
+                        // first.
+                        if (s == READY && policy == OVERFLOW_DROP_OLDEST) {
+                                int expected = READY;
+                                if (c.state.compare_exchange_strong(expected, WRITING,
+                                                std::memory_order_acq_rel)) {
+                                        tail.fetch_add(1, std::memory_order_acq_rel);
+                                        ndropped.fetch_add(1, std::memory_order_relaxed);
+                                        return &c.value;
+                                }
+                                continue;
+                        }
+
+                        backoff.wait();
+                }
+        }
+
+        /**
+         * Producer: hand the slot returned by acquire() to the consumer.
+         */
+        void publish()
+        {
+                cell_t& c = cells[head % n];
+                c.seq.store(head, std::memory_order_relaxed);
+                c.state.store(READY, std::memory_order_release);
+                head++;
+        }
+
+        /**
+         * Consumer: swap the oldest published slot into out.  Blocks while
+         * the ring is empty; returns false once it is empty and closed.
+         */
+        bool consume(T& out)
+        {
+                backoff_t backoff;
+
+                for (;;) {
+                        uint64_t t = tail.load(std::memory_order_acquire);
+                        cell_t& c = cells[t % n];
+                        int expected = READY;
+
+                        if (c.state.compare_exchange_strong(expected, READING,
+                                        std::memory_order_acq_rel)) {
+                                // A stale tail can land on a slot the producer
+                                // already recycled for a newer frame.
+                                if (c.seq.load(std::memory_order_relaxed) == t) {
+                                        using std::swap;
+                                        swap(out, c.value);
+                                        tail.store(t + 1, std::memory_order_release);
+                                        c.state.store(FREE, std::memory_order_release);
+                                        return true;
+                                }
+                                c.state.store(READY, std::memory_order_release);
+                                continue;
+                        }
+
+                        if (closed.load(std::memory_order_acquire)) {
+                                t = tail.load(std::memory_order_acquire);
+                                if (cells[t % n].state.load(std::memory_order_acquire) != READY)
+                                        return false;
+                                continue;
+                        }
+
+                        backoff.wait();
+                }
+        }
+
+        /**
+         * Either side: no more frames will be produced or consumed.  The
+         * consumer still drains what was published before the close.
+         */
+        void close() { closed.store(true, std::memory_order_release); }
+
+        bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+        uint64_t dropped() const { return ndropped.load(std::memory_order_relaxed); }
+
+private:
+        enum { FREE, WRITING, READY, READING };
+
+        struct cell_t {
+                std::atomic<int>      state;
+                std::atomic<uint64_t> seq;
+                T                     value;
+        };
+
+        /**
+         * Spin briefly, then yield, then sleep: waits are either very short
+         * (the other side is mid-swap) or a whole frame interval long.
+         */
+        struct backoff_t {
+                unsigned n = 0;
+
+                void wait()
+                {
+                        if (n >= 128)
+                                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                        else if (n >= 64)
+                                std::this_thread::yield();
+                        n++;
+                }
+        };
+
+        const unsigned                    n;
+        const overflow_policy             policy;
+        std::unique_ptr<cell_t[]>         cells;
+
+        alignas(64) uint64_t              head;     // producer only
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<bool>     closed;
+        std::atomic<uint64_t>             ndropped;
+};
+
+/**
+ * A decoded frame and its position in the input.
+ */
+struct frame_t {
+        cv::Mat  image;
+        unsigned num;       // frame number, restarts at 0 when the input loops
+        unsigned count;     // frames in the input, 0 if unknown
+        double   timestamp; // ms from the start of the input, restarts with num
+};
+
+/**
+ * Reads a frame_source_t on its own thread into a spsc_ring, so decode
+ * overlaps with the detectors and decode latency spikes are absorbed by
+ * the ring.  The ring depth is the read-ahead.
+ */
+class capture_t {
+public:
+        capture_t(unsigned depth = 4, overflow_policy policy = OVERFLOW_BLOCK)
+                : ring(depth, policy), loop(false)
+        {
+        }
+
+        ~capture_t()
+        {
+                close();
+                source.reset();
+        }
+
+        /**
+         * Open the input (see open_frame_source()) and start decoding.  With
+         * loop set the input starts over at its end, otherwise read()
+         * reports the end of the input.
+         */
+        bool open(const std::string& fname, bool loop)
+        {
+                this->loop = loop;
+
+                source = open_frame_source(fname);
+
+                if (!source)
+                        return false;
+
+                count = source->count();
+
+                const cv::Size size = source->size();
+
+                if (size.area() > 0) {
+                        for (unsigned i = 0; i < ring.size(); i++)
+                                ring.slot(i).image.create(size, CV_8UC3);
+                        spare.create(size, CV_8UC3);
+                }
+
+                thread = std::thread(&capture_t::run, this);
+
+                return true;
+        }
+
+        /**
+         * Take the next frame.  The buffer previously held by frame is
+         * handed back to the decoder.
+         */
+        bool read(frame_t& frame)
+        {
+                return ring.consume(frame);
+        }
+
+        /**
+         * Stop decoding.  The source stays open until the capture is
+         * destroyed: frames may point into it (see raw_source_t), and
+         * other threads may still be working on them.
+         */
+        void close()
+        {
+                ring.close();
+
+                if (thread.joinable())
+                        thread.join();
+        }
+
+        uint64_t dropped() const { return ring.dropped(); }
+
+        /**
+         * Of the open input.
+         */
+        cv::Size frame_size() const { return source ? source->size() : cv::Size(); }
+        double fps() const { return source ? source->fps() : DEFAULT_FPS; }
+
+private:
+        void run()
+        {
+                unsigned num = 0;
+
+                for (;;) {
+                        double timestamp = 0;
+
+                        // Decode into the spare buffer before claiming a
+                        // slot so a full ring never waits on the decoder;
+                        // the slot's old buffer becomes the spare.
+                        if (!source->read(spare, timestamp)) {
+                                // Give up on an input that yields no frames
+                                // even right after opening it.
+                                if (!loop || num == 0 || !source->rewind())
+                                        break;
+                                num = 0;
+                                continue;
+                        }
+
+                        frame_t* frame = ring.acquire();
+
+                        if (frame == NULL)
+                                return;
+
+                        std::swap(frame->image, spare);
+                        frame->num = num++;
+                        frame->count = count;
+                        frame->timestamp = timestamp;
+                        ring.publish();
+                }
+
+                ring.close();
+        }
+
+        spsc_ring<frame_t>              ring;
+        std::unique_ptr<frame_source_t> source;
+        cv::Mat                         spare;      // decoder only
+        std::thread                     thread;
+        bool                            loop;
+        unsigned                        count;
+};
+
+/**
+ * Paces display at the input's frame rate: next() is the delay to give
+ * waitKey() after showing a frame, the rest of the frame interval after
+ * whatever time went into the frame, at least 1 ms.
+ */
+class frame_pacer_t {
+public:
+        frame_pacer_t(double fps)
+                : interval_ms(1000 / (fps > 0 ? fps : DEFAULT_FPS)), last_ms(0)
+        {
+        }
+
+        int next()
+        {
+                struct timespec ts = {};
+                (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+                int64_t now_ms = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+                if (last_ms == 0) {
+                        last_ms = now_ms;
+                        return 1;
+                }
+
+                int64_t wait = (int64_t) (last_ms + interval_ms) - now_ms;
+
+                last_ms = now_ms;
+
+                return (int) std::min<int64_t>(std::max<int64_t>(wait, 1), (int64_t) interval_ms);
+        }
+
+private:
+        double  interval_ms;
+        int64_t last_ms;
+};
+
+#endif
@@ -1,24 +1,34 @@
 /* vim: set ts=8 sw=8 et : */
 
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <queue>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
+#include "capture.hpp"
+#include "geometry.hpp"
+#include "overlay.hpp"
+#include "preprocess.hpp"
+#include "shape_template.hpp"
+
 using namespace cv;
 using namespace std;
 
 const char*       VIDEO_FILE          = "../data/balance.m4v";
-double            VIDEO_FPS           = 30.293694;
 
 const char*       WINDOW_NAME         = "mainwindow";
 const int         WINDOW_WIDTH        = 1046;
@@ -36,6 +46,8 @@ const Scalar      SELECT_COLOR        = GREEN;
 const unsigned    TEXT_LINE_PITCH     = 16;
 
 const char*       DUMP_FNAME          = "modeldump";
+const char*       STDOUT_FNAME        = "-";
+const unsigned    DEFAULT_RING_DEPTH  = 4;
 
 const vector<Point2i> KEY_ZERO_OUTSIDE_CONTOUR =
 {
@@ -55,17 +67,51 @@ const vector<Point2i> KEY_ZERO_INSIDE_CONTOUR =
         {26, 23}, {30, 27}, {31, 32}
 };
 
+const shape_template_t KEY_ZERO_OUTSIDE_TEMPLATE(KEY_ZERO_OUTSIDE_CONTOUR);
+const shape_template_t KEY_ZERO_INSIDE_TEMPLATE(KEY_ZERO_INSIDE_CONTOUR);
+
 const double KEY_ZERO_OUTSIDE_ASPECT_RATIO = 1.6;
 const double KEY_ZERO_INSIDE_ASPECT_RATIO  = 2.55;
 const double KEY_ZERO_CONTOURS_AREA_RATIO  = 3.385;
 
+// Half-size of the key zero search window, in multiples of the key zero
+// size, indexed by the number of consecutive misses.  Once every window
+// has missed the track is dropped and the whole frame is scanned.
+const double   KEY_ZERO_SEARCH_SCALES[]    = { 0.75, 1.5, 3.0 };
+const unsigned KEY_ZERO_MAX_MISSES         =
+        sizeof(KEY_ZERO_SEARCH_SCALES) / sizeof(KEY_ZERO_SEARCH_SCALES[0]);
+
+// Fraction of the prediction error fed back into the velocity estimate
+const float    KEY_ZERO_VELOCITY_GAIN      = 0.5;
+
+// Limits for the outside contour prefilter.  They are deliberately loose:
+// they only have to throw out noise, the shape tests decide the rest.
+const unsigned KEY_ZERO_MIN_POINTS         = 20;
+const int      KEY_ZERO_MIN_SIDE           = 8;
+const double   KEY_ZERO_MAX_BOX_ASPECT     = 2 * KEY_ZERO_OUTSIDE_ASPECT_RATIO;
+const double   KEY_ZERO_MIN_BOX_FILL       = 0.3;
+const double   KEY_ZERO_SIZE_TOLERANCE     = 2.0;
+
+// Key zero cascade: the number of stages, how many lead stages stay in
+// place when reordering (has_child gates the inside contour tests), how
+// often the adaptive mode reorders, and the samples a stage needs first.
+const unsigned CASCADE_STAGES              = 9;
+const unsigned CASCADE_FIXED_STAGES        = 1;
+const unsigned CASCADE_REORDER_INTERVAL    = 50;
+const uint64_t CASCADE_MIN_SAMPLES         = 100;
+
+// Candidate selection on the downscaled frame of the pyramid search
+const unsigned KEY_ZERO_COARSE_MIN_POINTS     = 12;
+const double   KEY_ZERO_COARSE_MATCH          = 0.20;
+const unsigned KEY_ZERO_COARSE_MAX_CANDIDATES = 8;
+const unsigned KEY_ZERO_MAX_PYRAMID_LEVELS    = 4;
+
 enum model_state { UNRESOLVED = 0, VALID = 1 };
 
 typedef struct {
         int canny_threshold;
-
-        int      frame_wait; 
-        uint64_t frame_last_ts_ms;
+        binarize_mode binarize;
+        unsigned pyramid_levels;
 
         struct selection_t {
                 model_state state;
@@ -84,6 +130,13 @@ typedef struct {
                 Point2f pt;
                 Size size;
                 unsigned skip;
+
+                // constant velocity track of pt
+                bool tracking;
+                Point2f velocity;       // pixels per frame
+                unsigned age;           // frames since pt was measured
+                unsigned misses;        // consecutive failed searches
+                unsigned full_scans;    // searches of the whole frame
         } key_zero;
 
         struct zero_plate_t {
@@ -94,63 +147,41 @@ typedef struct {
         struct zero_tick_t {
                 model_state state;        
         } zero_tick;
-} model_t;
-
-/**
- * Find the acute angle of the major axes of two RotatedRects
- */
-static float rr_major_axis_delta(const RotatedRect& r1, const RotatedRect& r2)
-{
-        Point2f verts[4];
-        Point2f axis1, axis2;
-        vector<float> x, y, mag, ng;
-        float ng1, ng2;
-
-        r1.points(verts);
-        axis1 = verts[1] - verts[0];
-        axis2 = verts[3] - verts[0];
-        x = { axis1.x, axis2.x };
-        y = { axis1.y, axis2.y };
-        cartToPolar(x, y, mag, ng);
-        ng1 = ng[mag[0] > mag[1] ? 0 : 1] - M_PI;
-
-        r2.points(verts);
-        axis1 = verts[1] - verts[0];
-        axis2 = verts[3] - verts[0];
-        x = { axis1.x, axis2.x };
-        y = { axis1.y, axis2.y };
-        cartToPolar(x, y, mag, ng);
-        ng2 = ng[mag[0] > mag[1] ? 0 : 1] - M_PI;
- 
-        return abs(atan2(sin(ng1 - ng2), cos(ng1 - ng2)));
-}
-
-/**
- * Return the aspect ratio of a RotatedRect, where the major axis is the
- * height, regardless of orientation.
- */
-static float rr_aspect_ratio(const RotatedRect& r)
-{
-        Point2f verts[4];
-        Point2f axis1, axis2;
-        vector<float> x, y, mag;
 
-        r.points(verts);
-        axis1 = verts[1] - verts[0];
-        axis2 = verts[3] - verts[0];
-        x = { axis1.x, axis2.x };
-        y = { axis1.y, axis2.y };
-        magnitude(x, y, mag);
+        struct cascade_t {
+                bool adaptive;
+                bool timed;             // measure ns, for --stats or adaptive order
+                bool ready;
+                unsigned order[CASCADE_STAGES];
+                uint64_t searches;
+                uint64_t accepted;
+
+                struct stage_stats_t {
+                        uint64_t evaluated;
+                        uint64_t rejected;
+                        uint64_t ns;
+                } stats[CASCADE_STAGES];
+        } cascade;
+} model_t;
 
-        float height = max(mag[0], mag[1]);
-        float width  = min(mag[0], mag[1]);
- 
-        return height / width;
-}
+struct options_t {
+        bool            headless;
+        bool            bench_pyramid;
+        bool            adaptive_cascade;
+        bool            pipeline;
+        const char*     stats;
+        binarize_mode   binarize;
+        unsigned        pyramid_levels;
+        const char*     input;
+        const char*     output;
+        unsigned        ring_depth;
+        overflow_policy overflow;
+};
 
 static void get_selection_contours(model_t& model, Mat& scene)
 {
-        static Mat blur1, blur2, gray, binary;
+        static binarizer_t binarize;
+        static Mat binary;
         static vector<vector<Point>> contours;
         static vector<Vec4i> hierarchy;
         static vector<Point> hull;
@@ -162,10 +193,7 @@ static void get_selection_contours(model_t& model, Mat& scene)
 
         //cout << 's' << flush;
 
-        medianBlur(scene(model.selection.rect), blur1, 3);
-        bilateralFilter(blur1, blur2, 5, 75, 75);
-        cvtColor(blur2, gray, CV_BGR2GRAY);
-        threshold(gray, binary, 100, 255, THRESH_BINARY_INV);
+        binarize(scene(model.selection.rect), binary, model.binarize);
         findContours(binary, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_NONE);
 
         for (unsigned i = 0; i < hierarchy.size(); i++) {
@@ -193,7 +221,8 @@ static void get_selection_contours(model_t& model, Mat& scene)
 
 static void find_selection(model_t& model, Mat& scene)
 {
-        static Mat blur1, blur2, gray, binary;
+        static binarizer_t binarize;
+        static Mat binary;
         static vector<vector<Point>> contours;
         static vector<Vec4i> hierarchy;
         static vector<Point> hull;
@@ -224,10 +253,7 @@ static void find_selection(model_t& model, Mat& scene)
         //cout << 'z' << flush;
         model.key_zero.state = UNRESOLVED;
 
-        medianBlur(scene(roi), blur1, 3);
-        bilateralFilter(blur1, blur2, 5, 75, 75);
-        cvtColor(blur2, gray, CV_BGR2GRAY);
-        threshold(gray, binary, 100, 255, THRESH_BINARY_INV);
+        binarize(scene(roi), binary, model.binarize);
         findContours(binary, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_NONE);
 
         for (unsigned i = 0; i < contours.size(); i++) {
@@ -266,49 +292,312 @@ static void find_selection(model_t& model, Mat& scene)
         }
 }
 
-static void find_key_zero(model_t& model, Mat& scene)
+/**
+ * The window to search for key zero in: centred on where the track
+ * predicts it to be now, and larger after each consecutive miss.
+ */
+static Rect key_zero_search_roi(const model_t::key_zero_t& kz, const Size& frame)
+{
+        const double scale = KEY_ZERO_SEARCH_SCALES[min(kz.misses, KEY_ZERO_MAX_MISSES - 1)];
+        const Point2f center = kz.pt + kz.velocity * (float) kz.age;
+
+        Point p1, p2;
+        p1 = p2 = center;
+        p1.x -= kz.size.width * scale;
+        p1.y -= kz.size.height * scale;
+        p2.x += kz.size.width * scale;
+        p2.y += kz.size.height * scale;
+
+        return Rect(p1, p2) & Rect(Point(), frame);
+}
+
+/**
+ * Key zero was measured at pt: correct the velocity by the prediction
+ * error and restart the prediction from the measurement.
+ */
+static void key_zero_fix(model_t::key_zero_t& kz, const Point2f& pt, const Size& size)
+{
+        if (kz.tracking && kz.age > 0) {
+                const Point2f predicted = kz.pt + kz.velocity * (float) kz.age;
+                kz.velocity += (pt - predicted) * (KEY_ZERO_VELOCITY_GAIN / kz.age);
+        }
+        else {
+                kz.velocity = Point2f();
+        }
+
+        kz.pt = pt;
+        kz.size = size;
+        kz.state = VALID;
+        kz.tracking = true;
+        kz.age = 0;
+        kz.misses = 0;
+}
+
+static void key_zero_miss(model_t::key_zero_t& kz)
+{
+        if (kz.tracking && ++kz.misses >= KEY_ZERO_MAX_MISSES)
+                kz.tracking = false;
+}
+
+/**
+ * Integer-only tests on a candidate outside contour: enough points, a
+ * bounding box within [min_side, max_side] that is not too elongated, and
+ * an enclosed area that fills a reasonable part of the box.  Returns false
+ * for contours that cannot be key zero.
+ */
+static bool key_zero_prefilter(const vector<Point>& c, unsigned min_points,
+                int min_side, int max_side)
+{
+        if (c.size() < min_points)
+                return false;
+
+        int x0 = c[0].x, x1 = c[0].x, y0 = c[0].y, y1 = c[0].y;
+        int64_t area2 = 0;
+
+        for (size_t i = 0, j = c.size() - 1; i < c.size(); j = i++) {
+                x0 = min(x0, c[i].x);
+                x1 = max(x1, c[i].x);
+                y0 = min(y0, c[i].y);
+                y1 = max(y1, c[i].y);
+                area2 += (int64_t) c[j].x * c[i].y - (int64_t) c[i].x * c[j].y;
+        }
+
+        const int w = x1 - x0 + 1, h = y1 - y0 + 1;
+        const int lo = min(w, h), hi = max(w, h);
+
+        if (lo < min_side || hi > max_side)
+                return false;
+
+        if (hi > lo * KEY_ZERO_MAX_BOX_ASPECT)
+                return false;
+
+        if (llabs(area2) < 2 * KEY_ZERO_MIN_BOX_FILL * w * h)
+                return false;
+
+        return true;
+}
+
+/**
+ * One outside contour being tested as key zero.  The rotated rects are
+ * computed on first use, by whichever stage of the cascade needs them.
+ */
+struct key_zero_candidate_t {
+        const vector<Point>* outside;
+        const vector<Point>* inside;
+        int min_side, max_side;
+
+        bool have_outside_rr, have_inside_rr;
+        RotatedRect outside_rr_, inside_rr_;
+
+        const RotatedRect& outside_rr()
+        {
+                if (!have_outside_rr) {
+                        outside_rr_ = minAreaRect(*outside);
+                        have_outside_rr = true;
+                }
+                return outside_rr_;
+        }
+
+        const RotatedRect& inside_rr()
+        {
+                if (!have_inside_rr) {
+                        inside_rr_ = minAreaRect(*inside);
+                        have_inside_rr = true;
+                }
+                return inside_rr_;
+        }
+};
+
+// The contour must have an inside contour
+//
+static bool stage_has_child(key_zero_candidate_t& c)
+{
+        return c.inside != NULL;
+}
+
+// Cheap size and shape limits before any moments
+//
+static bool stage_prefilter(key_zero_candidate_t& c)
+{
+        return key_zero_prefilter(*c.outside, KEY_ZERO_MIN_POINTS, c.min_side, c.max_side);
+}
+
+// The contour must match the expected key zero outside contour
+//
+static bool stage_outside_match(key_zero_candidate_t& c)
+{
+        return KEY_ZERO_OUTSIDE_TEMPLATE.match_i3(*c.outside) <= 0.10;
+}
+
+// The contour must have the correct aspect ratio
+//
+static bool stage_outside_aspect(key_zero_candidate_t& c)
+{
+        return rr_aspect_ratio(c.outside_rr()) - KEY_ZERO_OUTSIDE_ASPECT_RATIO <= 0.1;
+}
+
+// The inside contour must match the expected key zero inside contour
+//
+static bool stage_inside_match(key_zero_candidate_t& c)
+{
+        return KEY_ZERO_INSIDE_TEMPLATE.match_i3(*c.inside) <= 0.10;
+}
+
+// The inside contour must have the correct aspect ratio
+//
+static bool stage_inside_aspect(key_zero_candidate_t& c)
+{
+        return rr_aspect_ratio(c.inside_rr()) - KEY_ZERO_INSIDE_ASPECT_RATIO <= 0.10; // TODO: 0.20
+}
+
+// The areas of the inside and outside contours must have the correct ratio
+//
+static bool stage_area_ratio(key_zero_candidate_t& c)
 {
-        static Mat blur1, blur2, gray, binary;
-        static vector<vector<Point>> contours;
-        static vector<Vec4i> hierarchy;
         static vector<Point> hull;
 
-        Rect roi;
-        double match_ratio, aspect_ratio;
-        RotatedRect outside_rr, inside_rr;
+        convexHull(*c.outside, hull);
+        double outside_area = contourArea(hull);
+        convexHull(*c.inside, hull);
+        double inside_area = contourArea(hull);
 
-        if (model.key_zero.state == VALID) {
-                if (++model.key_zero.skip < 5)
-                        return;
+        return outside_area / inside_area - KEY_ZERO_CONTOURS_AREA_RATIO <= 0.10;  // TODO: 0.15
+}
 
-                model.key_zero.skip = 0;
+// Orientation of the major axis of the contours must match
+//
+static bool stage_axis_delta(key_zero_candidate_t& c)
+{
+        return rr_major_axes_within(c.outside_rr(), c.inside_rr(), 0.1);
+}
 
-                Point p1, p2;
-                p1 = p2 = model.key_zero.pt;
-                p1.x -= model.key_zero.size.width * 0.75;
-                p1.y -= model.key_zero.size.height * 0.75;
-                p2.x += model.key_zero.size.width * 0.75;
-                p2.y += model.key_zero.size.height * 0.75;
-                roi = Rect(p1, p2);
+// The inside and outside contours must be concentric
+//
+static bool stage_concentric(key_zero_candidate_t& c)
+{
+        return points_within(c.outside_rr().center, c.inside_rr().center,
+                        c.outside_rr().size.height * 0.1);
+}
+
+static const struct {
+        const char* name;
+        bool (*pass)(key_zero_candidate_t&);
+} KEY_ZERO_STAGES[CASCADE_STAGES] = {
+        { "has_child",      stage_has_child      },
+        { "prefilter",      stage_prefilter      },
+        { "outside_match",  stage_outside_match  },
+        { "outside_aspect", stage_outside_aspect },
+        { "inside_match",   stage_inside_match   },
+        { "inside_aspect",  stage_inside_aspect  },
+        { "area_ratio",     stage_area_ratio     },
+        { "axis_delta",     stage_axis_delta     },
+        { "concentric",     stage_concentric     },
+};
+
+static uint64_t now_ns()
+{
+        struct timespec ts = {};
+        (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Put the reorderable stages in increasing order of cost per rejection,
+ * (time per test) / (fraction rejected), which for independent tests is
+ * the order with the least expected work per candidate.  Stages that have
+ * not been measured keep their place behind the measured ones.
+ */
+static void cascade_reorder(model_t::cascade_t& cascade)
+{
+        double rank[CASCADE_STAGES];
+
+        for (unsigned s = 0; s < CASCADE_STAGES; s++) {
+                const model_t::cascade_t::stage_stats_t& st = cascade.stats[s];
+
+                if (st.evaluated < CASCADE_MIN_SAMPLES)
+                        rank[s] = HUGE_VAL;
+                else if (st.rejected == 0)
+                        rank[s] = DBL_MAX;
+                else
+                        rank[s] = (double) st.ns / st.rejected;
         }
-        else {
-                roi = Rect(Point(),Point(scene.size().width,scene.size().height));
+
+        stable_sort(cascade.order + CASCADE_FIXED_STAGES, cascade.order + CASCADE_STAGES,
+                    [&rank](unsigned a, unsigned b) { return rank[a] < rank[b]; });
+}
+
+/**
+ * Run the candidate through every stage in the current order, counting
+ * tests and rejections per stage, and time when the cascade is timed; the
+ * stages are cheap enough that the clock would cost as much as the tests.
+ */
+static bool cascade_pass(model_t::cascade_t& cascade, key_zero_candidate_t& c)
+{
+        if (!cascade.ready) {
+                for (unsigned s = 0; s < CASCADE_STAGES; s++)
+                        cascade.order[s] = s;
+                cascade.ready = true;
         }
 
-        model.key_zero.state = UNRESOLVED;
+        for (unsigned k = 0; k < CASCADE_STAGES; k++) {
+                const unsigned s = cascade.order[k];
+                model_t::cascade_t::stage_stats_t& st = cascade.stats[s];
 
-        medianBlur(scene(roi), blur1, 3);
-        bilateralFilter(blur1, blur2, 5, 75, 75);
-        cvtColor(blur2, gray, CV_BGR2GRAY);
-        threshold(gray, binary, 100, 255, THRESH_BINARY_INV);
-        findContours(binary, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_NONE);
+                bool pass;
+
+                if (cascade.timed) {
+                        uint64_t t0 = now_ns();
+                        pass = KEY_ZERO_STAGES[s].pass(c);
+                        st.ns += now_ns() - t0;
+                }
+                else {
+                        pass = KEY_ZERO_STAGES[s].pass(c);
+                }
+                st.evaluated++;
 
-#define _continue \
-{ \
-        cout << __LINE__ << endl; \
-        continue; \
+                if (!pass) {
+                        st.rejected++;
+                        return false;
+                }
+        }
+
+        cascade.accepted++;
+
+        return true;
 }
 
+/**
+ * Look for key zero in roi.  On success found is the rotated rect of its
+ * outside contour, in scene coordinates.
+ */
+static bool detect_key_zero(model_t& model, const Mat& scene, const Rect& roi,
+                RotatedRect& found)
+{
+        static binarizer_t binarize;
+        static Mat binary;
+        static vector<vector<Point>> contours;
+        static vector<Vec4i> hierarchy;
+
+        const model_t::key_zero_t& kz = model.key_zero;
+        model_t::cascade_t& cascade = model.cascade;
+        int min_side, max_side;
+
+        // While tracking the size is known; otherwise anything that fits
+        if (kz.tracking) {
+                min_side = min(kz.size.width, kz.size.height) / KEY_ZERO_SIZE_TOLERANCE;
+                max_side = max(kz.size.width, kz.size.height) * KEY_ZERO_SIZE_TOLERANCE;
+        }
+        else {
+                min_side = KEY_ZERO_MIN_SIDE;
+                max_side = max(roi.width, roi.height);
+        }
+
+        if (cascade.adaptive && ++cascade.searches % CASCADE_REORDER_INTERVAL == 0)
+                cascade_reorder(cascade);
+
+        binarize(scene(roi), binary, model.binarize);
+        findContours(binary, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_NONE);
+
         for (unsigned i = 0; i < contours.size(); i++) {
 
                 // Consider only outside contours
@@ -316,78 +605,154 @@ static void find_key_zero(model_t& model, Mat& scene)
                 if (hierarchy[i][3] >= 0)
                         continue;
 
-                // The contour must match the expected key zero outside contour
-                //
-                match_ratio = matchShapes(KEY_ZERO_OUTSIDE_CONTOUR,
-                                contours[i], CV_CONTOURS_MATCH_I3, 0);
+                key_zero_candidate_t c = {};
+                c.outside = &contours[i];
+                c.inside = hierarchy[i][2] >= 0 ? &contours[hierarchy[i][2]] : NULL;
+                c.min_side = min_side;
+                c.max_side = max_side;
 
-                if (match_ratio > 0.10) // poor match
+                if (!cascade_pass(cascade, c))
                         continue;
 
-                // The contour must have the correct aspect ratio
-                //
-                outside_rr = minAreaRect(contours[i]);
-                aspect_ratio = rr_aspect_ratio(outside_rr);
+                found = c.outside_rr();
+                found.center += Point2f(roi.x, roi.y);
+
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * Per stage counters of the key zero cascade as CSV.
+ */
+static void write_cascade_stats(ostream& os, const model_t::cascade_t& cascade)
+{
+        os << "position,stage,evaluated,rejected,rejected_pct,total_ms,ns_per_test" << '\n';
 
-                if (aspect_ratio - KEY_ZERO_OUTSIDE_ASPECT_RATIO > 0.1)
+        for (unsigned k = 0; k < CASCADE_STAGES; k++) {
+                const unsigned s = cascade.ready ? cascade.order[k] : k;
+                const model_t::cascade_t::stage_stats_t& st = cascade.stats[s];
+
+                os << k << ',' << KEY_ZERO_STAGES[s].name << ','
+                   << st.evaluated << ',' << st.rejected << ','
+                   << (st.evaluated ? 100.0 * st.rejected / st.evaluated : 0) << ','
+                   << st.ns / 1e6 << ','
+                   << (st.evaluated ? (double) st.ns / st.evaluated : 0) << '\n';
+        }
+
+        os << "accepted," << cascade.accepted << '\n';
+}
+
+/**
+ * Look for key zero in the whole frame, coarse to fine: candidates are
+ * picked on a 1/2^levels scaled copy of the frame, where the Gaussian
+ * pyramid already does the smoothing, and each is confirmed with
+ * detect_key_zero in a small window of the full resolution frame.
+ */
+static bool detect_key_zero_pyramid(model_t& model, const Mat& scene, unsigned levels,
+                RotatedRect& found)
+{
+        static vector<Mat> pyramid;
+        static Mat gray, binary;
+        static vector<vector<Point>> contours;
+        static vector<Vec4i> hierarchy;
+        static vector<pair<double, Rect>> candidates;
+
+        // Stop before the coarse frame shrinks away
+        levels = min(levels, KEY_ZERO_MAX_PYRAMID_LEVELS);
+        while (levels > 0 && min(scene.cols, scene.rows) >> levels == 0)
+                levels--;
+
+        const int scale = 1 << levels;
+        const Rect frame(Point(), scene.size());
+
+        buildPyramid(scene, pyramid, levels);
+        cvtColor(pyramid[levels], gray, CV_BGR2GRAY);
+        threshold(gray, binary, 100, 255, THRESH_BINARY_INV);
+        findContours(binary, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_NONE);
+
+        candidates.clear();
+
+        for (unsigned i = 0; i < contours.size(); i++) {
+                // Outside contours with a hole, big enough to have a shape
+                if (hierarchy[i][3] >= 0 || hierarchy[i][2] < 0)
                         continue;
 
-                // The contour must have an inside contour
-                //
-                if (hierarchy[i][2] < 0)
+                if (!key_zero_prefilter(contours[i], KEY_ZERO_COARSE_MIN_POINTS,
+                                max(2, KEY_ZERO_MIN_SIDE / scale),
+                                max(binary.cols, binary.rows)))
                         continue;
 
-                vector<Point>& inside_contour = contours[hierarchy[i][2]];
+                double match_ratio = KEY_ZERO_OUTSIDE_TEMPLATE.match_i3(contours[i]);
 
-                // The inside contour must match the expected key zero inside contour
-                //
-                match_ratio = matchShapes(KEY_ZERO_INSIDE_CONTOUR,
-                                inside_contour, CV_CONTOURS_MATCH_I3, 0);
+                if (match_ratio > KEY_ZERO_COARSE_MATCH)
+                        continue;
 
-                if (match_ratio > 0.10)
-                        _continue;
+                Rect r = boundingRect(contours[i]);
+                candidates.push_back(make_pair(match_ratio,
+                        Rect(r.x * scale, r.y * scale, r.width * scale, r.height * scale)));
+        }
 
-                // The inside contour must have the correct aspect ratio
-                //
-                inside_rr = minAreaRect(inside_contour);
-                aspect_ratio = rr_aspect_ratio(inside_rr);
+        sort(candidates.begin(), candidates.end(),
+             [](const pair<double, Rect>& a, const pair<double, Rect>& b) {
+                return a.first < b.first;
+             });
 
-                if (aspect_ratio - KEY_ZERO_INSIDE_ASPECT_RATIO > 0.10) // TODO: 0.20
-                        _continue;
+        for (unsigned i = 0; i < candidates.size() && i < KEY_ZERO_COARSE_MAX_CANDIDATES; i++) {
+                const Rect& r = candidates[i].second;
+                const Point2f center(r.x + r.width / 2.0f, r.y + r.height / 2.0f);
+                const float mx = r.width * KEY_ZERO_SEARCH_SCALES[0] + scale;
+                const float my = r.height * KEY_ZERO_SEARCH_SCALES[0] + scale;
 
-                // The areas of the inside and outside contours must have the correct ratio
-                //
-                convexHull(contours[i], hull);
-                double outside_area = contourArea(hull);
-                convexHull(inside_contour, hull);
-                double inside_area = contourArea(hull);
+                Rect roi = Rect(Point(center.x - mx, center.y - my),
+                                Point(center.x + mx, center.y + my)) & frame;
 
-                if (outside_area / inside_area - KEY_ZERO_CONTOURS_AREA_RATIO > 0.10)  // TODO: 0.15
-                        _continue;
+                if (roi.area() > 0 && detect_key_zero(model, scene, roi, found))
+                        return true;
+        }
 
-                // Orientation of the major axis of the contours must match
-                //
-                if (rr_major_axis_delta(outside_rr, inside_rr) > 0.1)
-                        _continue;
+        return false;
+}
 
-                // The inside and outside contours must be concentric
-                //
-                Point2f dcenter = outside_rr.center - inside_rr.center;
-                
-                if (sqrt(pow(dcenter.x, 2) + pow(dcenter.y, 2)) > outside_rr.size.height * 0.1)
-                        _continue;
+static void find_key_zero(model_t& model, Mat& scene)
+{
+        model_t::key_zero_t& kz = model.key_zero;
+        Rect roi;
+        RotatedRect found;
+        bool hit;
 
-                if (contours[i].size() < 5)
-                        _continue;
+        kz.age++;
 
-                model.key_zero.pt = outside_rr.center;
-                model.key_zero.pt.x += roi.x;
-                model.key_zero.pt.y += roi.y;
-                model.key_zero.size = outside_rr.boundingRect().size();
-                model.key_zero.state = VALID;
+        if (kz.state == VALID) {
+                if (++kz.skip < 5)
+                        return;
 
-                return;
+                kz.skip = 0;
+        }
+
+        kz.state = UNRESOLVED;
+
+        if (kz.tracking) {
+                roi = key_zero_search_roi(kz, scene.size());
+                hit = roi.area() > 0 && detect_key_zero(model, scene, roi, found);
+        }
+        else {
+                kz.full_scans++;
+
+                if (model.pyramid_levels > 0) {
+                        hit = detect_key_zero_pyramid(model, scene, model.pyramid_levels, found);
+                }
+                else {
+                        roi = Rect(Point(),Point(scene.size().width,scene.size().height));
+                        hit = detect_key_zero(model, scene, roi, found);
+                }
         }
+
+        if (hit)
+                key_zero_fix(kz, found.center, found.boundingRect().size());
+        else
+                key_zero_miss(kz);
 }
 
 static void find_zero_tick(model_t& model, Mat& scene)
@@ -498,15 +863,15 @@ static void handle_mouse_event(int e, int x, int y, int flags, void* param)
         selection.rect.height = SELECT_SIZE.height;
 }
 
-static void draw_pip(model_t& model, Mat& scene)
+static void draw_pip(model_t& model, const Mat& scene, overlay_t& overlay)
 {
         Rect pip_rect(Point(), SELECT_SIZE);
-        scene(model.selection.rect).copyTo(scene(pip_rect));
+        overlay.image(scene(model.selection.rect), pip_rect);
 }
 
-static void draw_selection(model_t& model, Mat& scene)
+static void draw_selection(model_t& model, overlay_t& overlay)
 {
-        rectangle(scene, model.selection.rect, SELECT_COLOR, SELECT_LINE_WIDTH);
+        overlay.rectangle(model.selection.rect, SELECT_COLOR, SELECT_LINE_WIDTH);
 
         if (model.selection.state != VALID)
                 return;
@@ -526,10 +891,10 @@ static void draw_selection(model_t& model, Mat& scene)
         for (i = 0; i < c.size(); i++) c[i] *= 10;
         cx.push_back(c);
 
-        drawContours(scene, cx, -1, WHITE, 1, 8);
+        overlay.contours(cx, WHITE, 1, 8);
 }
 
-static void draw_match(model_t& model, Mat& scene)
+static void draw_match(model_t& model, overlay_t& overlay)
 {
         if (model.key_zero.state != VALID)
                 return;
@@ -538,11 +903,11 @@ static void draw_match(model_t& model, Mat& scene)
 
         p1 = p2 = model.key_zero.pt;
         p1.x -= 7; p1.y -= 7; p2.x += 7; p2.y += 7;
-        line(scene, p1, p2, RED, 3);
+        overlay.line(p1, p2, RED, 3);
 
         p1 = p2 = model.key_zero.pt;
         p1.x -= 7; p1.y += 7; p2.x += 7; p2.y -= 7;
-        line(scene, p1, p2, RED, 3);
+        overlay.line(p1, p2, RED, 3);
 }
 
 static string get_mat_type_name(const Mat& mat)
@@ -594,7 +959,7 @@ static string get_mat_type_name(const Mat& mat)
         return r;
 }
 
-static void draw_zero_plate_stuff(model_t& model, Mat& scene)
+static void draw_zero_plate_stuff(model_t& model, const Mat& scene, overlay_t& overlay)
 {
         if (model.zero_plate.state != VALID)
                 return;
@@ -633,100 +998,496 @@ static void draw_zero_plate_stuff(model_t& model, Mat& scene)
                 p[i + 2] = 255;
         }
 
-        mat.copyTo(scene(Rect(100, 360, 90, 100)));
+        overlay.image(mat, Rect(100, 360, 90, 100));
 }
 
-static void draw_metrics(Mat& scene, VideoCapture& vc)
+static void draw_metrics(const Mat& scene, const frame_t& frame, overlay_t& overlay)
 {
         static char s[4096];
 
-        const int LEFT = vc.get(CV_CAP_PROP_FRAME_WIDTH) - 200;
+        const int LEFT = scene.cols - 200;
 
-        sprintf(s, "TOTAL: %5u", (unsigned) vc.get(CV_CAP_PROP_FRAME_COUNT));
-        putText(scene, s, Point(LEFT, TEXT_LINE_PITCH * 1), FONT_HERSHEY_PLAIN, 1, WHITE);
+        sprintf(s, "TOTAL: %5u", frame.count);
+        overlay.text(s, Point(LEFT, TEXT_LINE_PITCH * 1), FONT_HERSHEY_PLAIN, 1, WHITE);
 
-        sprintf(s, "F#:  %5u", (unsigned) vc.get(CV_CAP_PROP_POS_FRAMES));
-        putText(scene, s, Point(LEFT, TEXT_LINE_PITCH * 2), FONT_HERSHEY_PLAIN, 1, WHITE);
+        sprintf(s, "F#:  %5u", frame.num + 1);
+        overlay.text(s, Point(LEFT, TEXT_LINE_PITCH * 2), FONT_HERSHEY_PLAIN, 1, WHITE);
 }
 
-static void read_frame(VideoCapture& vc, Mat& m)
+static void dump_model(model_t& model)
 {
-        unsigned frame_count, frame_num;
+        ofstream os;
+
+        os.open(DUMP_FNAME, ios::trunc);
+
+        os << "inside: ";
+        for (auto it : model.selection.inside.points)
+                os << it;
+        os << endl;
 
-        if (vc.isOpened()) {
-                frame_count = (unsigned) vc.get(CV_CAP_PROP_FRAME_COUNT);
-                frame_num   = (unsigned) vc.get(CV_CAP_PROP_POS_FRAMES);
+        os << "outside: ";
+        for (auto it : model.selection.outside.points)
+                os << it;
+        os << endl;
 
-                if (frame_num == frame_count)
-                        vc.release();
+        os << "aspect ratio: " << model.selection.aspect_ratio << endl;
+}
+
+static void emit_header(ostream& os)
+{
+        os << "frame,key_zero_state,key_zero_x,key_zero_y,"
+              "key_zero_width,key_zero_height,zero_plate_state" << '\n';
+}
+
+/**
+ * Write one CSV record per frame with the key zero detection results.
+ */
+static void emit_record(ostream& os, unsigned frame_num, const model_t& model)
+{
+        const model_t::key_zero_t& kz = model.key_zero;
+
+        os << frame_num << ','
+           << kz.state << ','
+           << kz.pt.x << ',' << kz.pt.y << ','
+           << kz.size.width << ',' << kz.size.height << ','
+           << model.zero_plate.state << '\n';
+}
+
+/**
+ * Run every detector on the frame; the detectors read scene but never
+ * draw on it.
+ */
+static void find_all(model_t& model, Mat& scene)
+{
+//        get_selection_contours(model, scene);
+//        find_selection(model, scene);
+        find_key_zero(model, scene);
+        find_zero_tick(model, scene);
+        find_zero_plate_right_edge(model, scene);
+}
+
+/**
+ * A frame with the detector results for it, passed from the detect stage
+ * to the annotate/emit stage of the pipeline.
+ */
+struct detected_t {
+        frame_t  frame;
+        model_t  model;
+        unsigned frame_num;
+};
+
+/**
+ * Copy the detector state for the frame just processed.  model_t is copied
+ * member by member, but the histogram is rewritten in place by the next
+ * calcHist, so it gets its own buffer, recycled with the ring slot.
+ */
+static void snapshot_model(model_t& dst, const model_t& src)
+{
+        Mat hist = dst.zero_plate.histogram;
+
+        dst = src;
+        src.zero_plate.histogram.copyTo(hist);
+        dst.zero_plate.histogram = hist;
+}
+
+/**
+ * Busy time of the two pipeline stages, to tell which one limits the
+ * frame rate.
+ */
+struct stage_times_t {
+        double   detect_ms;
+        double   emit_ms;
+        unsigned frames;
+};
+
+/**
+ * The detect stage: take decoded frames in order, run the detectors on the
+ * stage's own model, and hand each frame with a snapshot of the model to
+ * the next stage.  The model is only ever touched by this thread, so the
+ * key zero track carries from frame to frame exactly as in the serial
+ * loop.  Stops at the end of the input or when the ring is closed by the
+ * consumer.
+ */
+static void detect_stage(capture_t& capture, model_t& model,
+                spsc_ring<detected_t>& ring, stage_times_t& times)
+{
+        frame_t frame;
+        unsigned frame_num = 0;
+
+        while (capture.read(frame)) {
+                struct timespec t0 = {}, t1 = {};
+
+                (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+                find_all(model, frame.image);
+                (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+                times.detect_ms += (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+                detected_t* out = ring.acquire();
+
+                if (out == NULL)
+                        return;
+
+                swap(out->frame, frame);
+                snapshot_model(out->model, model);
+                out->frame_num = frame_num++;
+                ring.publish();
         }
 
-        if (!vc.isOpened()) {
-                if (!vc.open(VIDEO_FILE)) {
-                        CV_Error_(-1, ("failed to open video: \"%s\"", VIDEO_FILE));
-                        exit(1);
+        ring.close();
+}
+
+/**
+ * The next frame and the detector results for it, in input order, or NULL
+ * at the end of the input.  Pipelined, both come from the detect stage and
+ * the results are the snapshot in item; otherwise the frame is decoded and
+ * the detectors run on model right here.
+ */
+static model_t* next_detected(bool pipelined, capture_t& capture, model_t& model,
+                spsc_ring<detected_t>& ring, detected_t& item)
+{
+        if (pipelined)
+                return ring.consume(item) ? &item.model : NULL;
+
+        if (!capture.read(item.frame))
+                return NULL;
+
+        find_all(model, item.frame.image);
+
+        return &model;
+}
+
+static void print_stage_times(ostream& os, const stage_times_t& times, double secs)
+{
+        unsigned n = max(times.frames, 1u);
+
+        os << "pipeline: detect " << times.detect_ms / n << " ms/frame, "
+           << "annotate/emit " << times.emit_ms / n << " ms/frame";
+
+        if (secs > 0)
+                os << ", " << times.frames / secs << " fps";
+
+        os << endl;
+}
+
+static void usage(const char* prog)
+{
+        cerr << "usage: " << prog << " [--headless] [--ring-depth n] [--drop-oldest]"
+                " [--fast-binarize]" << endl
+             << "       [--pyramid levels] [--bench-pyramid] [--adaptive-cascade]"
+                " [--stats file]" << endl
+             << "       [--pipeline]"
+             << " [input [output]]" << endl
+             << endl
+             << "  input       video file, image directory or pattern, or raw frame"
+                " file" << endl
+             << "              (default: " << VIDEO_FILE << ")" << endl
+             << "  output      per-frame CSV records, \"" << STDOUT_FNAME
+             << "\" for stdout" << endl
+             << "              (default: none, or stdout when headless)" << endl
+             << "  --headless  no window, no drawing, no frame pacing; stop at"
+                " end of input" << endl
+             << "  --ring-depth n" << endl
+             << "              frames decoded ahead on the capture thread"
+                " (default: " << DEFAULT_RING_DEPTH << ")" << endl
+             << "  --drop-oldest" << endl
+             << "              when the detectors fall behind, drop the oldest"
+                " decoded frame" << endl
+             << "              instead of stalling the decoder" << endl
+             << "  --fast-binarize" << endl
+             << "              fused approximate preprocessing instead of the"
+                " exact filter chain" << endl
+             << "  --pyramid levels" << endl
+             << "              look for key zero candidates on a 1/2^levels scaled"
+                " frame when" << endl
+             << "              the whole frame has to be searched, levels 0 to "
+             << KEY_ZERO_MAX_PYRAMID_LEVELS << endl
+             << "              (default: 0, off)" << endl
+             << "  --bench-pyramid" << endl
+             << "              run the full resolution and pyramid (1/2 and 1/4)"
+                " whole frame" << endl
+             << "              searches on every frame and report time and recall" << endl
+             << "  --adaptive-cascade" << endl
+             << "              reorder the key zero tests by measured cost per"
+                " rejection" << endl
+             << "  --pipeline  detect on one thread while the previous frame is"
+                " drawn and" << endl
+             << "              written on another" << endl
+             << "  --stats file" << endl
+             << "              write per-stage key zero rejection counts and"
+                " times as CSV" << endl
+             << "              at the end of the run" << endl;
+}
+
+static bool parse_args(int argc, const char** argv, options_t& opts)
+{
+        const char** positional[] = { &opts.input, &opts.output };
+        unsigned npositional = 0;
+
+        opts.headless   = false;
+        opts.bench_pyramid = false;
+        opts.adaptive_cascade = false;
+        opts.pipeline   = false;
+        opts.stats      = NULL;
+        opts.binarize   = BINARIZE_EXACT;
+        opts.pyramid_levels = 0;
+        opts.input      = VIDEO_FILE;
+        opts.output     = NULL;
+        opts.ring_depth = DEFAULT_RING_DEPTH;
+        opts.overflow   = OVERFLOW_BLOCK;
+
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--headless"))
+                        opts.headless = true;
+                else if (!strcmp(argv[i], "--ring-depth") && i + 1 < argc)
+                        opts.ring_depth = atoi(argv[++i]);
+                else if (!strcmp(argv[i], "--drop-oldest"))
+                        opts.overflow = OVERFLOW_DROP_OLDEST;
+                else if (!strcmp(argv[i], "--fast-binarize"))
+                        opts.binarize = BINARIZE_FAST;
+                else if (!strcmp(argv[i], "--pyramid") && i + 1 < argc) {
+                        int levels = atoi(argv[++i]);
+                        if (levels < 0 || levels > (int) KEY_ZERO_MAX_PYRAMID_LEVELS)
+                                return false;
+                        opts.pyramid_levels = levels;
                 }
+                else if (!strcmp(argv[i], "--bench-pyramid"))
+                        opts.bench_pyramid = true;
+                else if (!strcmp(argv[i], "--adaptive-cascade"))
+                        opts.adaptive_cascade = true;
+                else if (!strcmp(argv[i], "--pipeline"))
+                        opts.pipeline = true;
+                else if (!strcmp(argv[i], "--stats") && i + 1 < argc)
+                        opts.stats = argv[++i];
+                else if (argv[i][0] == '-' && argv[i][1] == '-')
+                        return false;
+                else if (npositional < 2)
+                        *positional[npositional++] = argv[i];
+                else
+                        return false;
         }
 
-        vc.read(m);
+        if (opts.headless && opts.output == NULL)
+                opts.output = STDOUT_FNAME;
+
+        return true;
 }
 
-static void compute_interval(model_t& model)
+/**
+ * Write the key zero cascade counters to the --stats file, if one was given.
+ */
+static bool save_cascade_stats(const options_t& opts, const model_t& model)
 {
-        struct timespec ts = {};
-        (void) clock_gettime(CLOCK_MONOTONIC, &ts);
-        uint64_t ts_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        if (opts.stats == NULL)
+                return true;
 
-        if (model.frame_last_ts_ms == 0) {
-                model.frame_last_ts_ms = ts_ms;
-                model.frame_wait = 1;
-                return;
+        ofstream ofs(opts.stats, ios::trunc);
+
+        if (ofs)
+                write_cascade_stats(ofs, model.cascade);
+
+        if (!ofs) {
+                cerr << "failed to write stats: \"" << opts.stats << '"' << endl;
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Run the detectors on every frame as fast as possible, without any of the
+ * highgui window handling, and stop at the end of the input.
+ */
+static int run_headless(const options_t& opts, ostream& out)
+{
+        capture_t capture(opts.ring_depth, opts.overflow);
+        spsc_ring<detected_t> ring(opts.ring_depth, OVERFLOW_BLOCK);
+        stage_times_t times = {};
+        thread detector;
+        model_t model = {};
+        model_t* result;
+        detected_t item;
+
+        model.binarize = opts.binarize;
+        model.pyramid_levels = opts.pyramid_levels;
+        model.cascade.adaptive = opts.adaptive_cascade;
+        model.cascade.timed = opts.adaptive_cascade || opts.stats != NULL;
+        unsigned frame_num = 0;
+
+        if (!capture.open(opts.input, false)) {
+                cerr << "failed to open input: \"" << opts.input << '"' << endl;
+                return 1;
+        }
+
+        struct timespec t0 = {}, t1 = {};
+        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        if (opts.pipeline)
+                detector = thread(detect_stage, ref(capture), ref(model), ref(ring), ref(times));
+
+        while ((result = next_detected(opts.pipeline, capture, model, ring, item)) != NULL) {
+                struct timespec e0 = {}, e1 = {};
+
+                (void) clock_gettime(CLOCK_MONOTONIC, &e0);
+                emit_record(out, frame_num++, *result);
+                (void) clock_gettime(CLOCK_MONOTONIC, &e1);
+                times.emit_ms += (e1.tv_sec - e0.tv_sec) * 1e3 + (e1.tv_nsec - e0.tv_nsec) / 1e6;
         }
 
-        uint64_t next_frame_ts_ms = model.frame_last_ts_ms + 1000 / VIDEO_FPS;
-        model.frame_wait = next_frame_ts_ms - ts_ms;
+        if (detector.joinable())
+                detector.join();
+
+        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+        cerr << frame_num << " frames in " << secs << " s ("
+             << (secs > 0 ? frame_num / secs : 0) << " fps), "
+             << capture.dropped() << " dropped, "
+             << model.key_zero.full_scans << " full frame key zero scans" << endl;
 
-        if (model.frame_wait < 1)
-                model.frame_wait = 1;
+        if (opts.pipeline) {
+                times.frames = frame_num;
+                print_stage_times(cerr, times, secs);
+        }
+
+        capture.close();
+        out.flush();
 
-        if (model.frame_wait > 1000 / VIDEO_FPS)
-                model.frame_wait = 1000 / VIDEO_FPS;
+        if (opts.stats != NULL)
+                write_cascade_stats(cerr, model.cascade);
 
-        model.frame_last_ts_ms = ts_ms;
+        return save_cascade_stats(opts, model) ? 0 : 1;
 }
 
-static void dump_model(model_t& model)
+static double elapsed_ms(const struct timespec& t0, const struct timespec& t1)
 {
-        ofstream os;
+        return (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+}
 
-        os.open(DUMP_FNAME, ios::trunc);
+/**
+ * Compare the whole frame key zero search at full resolution with the
+ * pyramid search at 1/2 and 1/4 scale on every frame of the input.  A
+ * pyramid detection counts as a hit when it lands within a quarter of the
+ * key zero size of the full resolution one.
+ */
+static int run_bench_pyramid(const options_t& opts)
+{
+        const unsigned LEVELS = 2;
 
-        os << "inside: ";
-        for (auto it : model.selection.inside.points)
-                os << it;
-        os << endl;
+        capture_t capture(opts.ring_depth, OVERFLOW_BLOCK);
+        model_t model = {};
+        frame_t frame;
+        Mat& scene = frame.image;
 
-        os << "outside: ";
-        for (auto it : model.selection.outside.points)
-                os << it;
-        os << endl;
+        double full_ms = 0, pyr_ms[LEVELS + 1] = {};
+        unsigned frames = 0, full_hits = 0;
+        unsigned pyr_hits[LEVELS + 1] = {}, pyr_agree[LEVELS + 1] = {};
 
-        os << "aspect ratio: " << model.selection.aspect_ratio << endl;
+        model.binarize = opts.binarize;
+
+        if (!capture.open(opts.input, false)) {
+                cerr << "failed to open input: \"" << opts.input << '"' << endl;
+                return 1;
+        }
+
+        while (capture.read(frame)) {
+                struct timespec t0 = {}, t1 = {};
+                RotatedRect full, pyr;
+                Rect roi(Point(), scene.size());
+
+                (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+                bool full_hit = detect_key_zero(model, scene, roi, full);
+                (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+                full_ms += elapsed_ms(t0, t1);
+                full_hits += full_hit;
+
+                for (unsigned l = 1; l <= LEVELS; l++) {
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+                        bool hit = detect_key_zero_pyramid(model, scene, l, pyr);
+                        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+                        pyr_ms[l] += elapsed_ms(t0, t1);
+                        pyr_hits[l] += hit;
+
+                        if (hit && full_hit) {
+                                Point2f d = pyr.center - full.center;
+                                float tol = max(full.size.width, full.size.height) * 0.25f;
+                                pyr_agree[l] += d.x * d.x + d.y * d.y <= tol * tol;
+                        }
+                }
+
+                frames++;
+        }
+
+        capture.close();
+
+        if (frames == 0)
+                return 1;
+
+        cout << "frames " << frames << endl
+             << "full:     " << setw(8) << fixed << setprecision(3)
+             << full_ms / frames << " ms/frame, " << full_hits << " detections" << endl;
+
+        for (unsigned l = 1; l <= LEVELS; l++) {
+                cout << "1/" << (1 << l) << " pyr: " << setw(8)
+                     << pyr_ms[l] / frames << " ms/frame, " << pyr_hits[l]
+                     << " detections, speedup " << setprecision(2)
+                     << (pyr_ms[l] > 0 ? full_ms / pyr_ms[l] : 0) << "x, recall "
+                     << (full_hits ? 100.0 * pyr_agree[l] / full_hits : 100.0) << "%, "
+                     << pyr_hits[l] - pyr_agree[l] << " not matching full" << endl
+                     << setprecision(3);
+        }
+
+        return 0;
 }
 
 int main(int argc, const char** argv)
 {
-        VideoCapture vc;
+        options_t opts;
+        ofstream ofs;
 
         bool pause = false;
         bool run = true;
         int key;
 
+        if (!parse_args(argc, argv, opts)) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (opts.bench_pyramid)
+                return run_bench_pyramid(opts);
+
+        if (opts.output != NULL && strcmp(opts.output, STDOUT_FNAME)) {
+                ofs.open(opts.output, ios::trunc);
+                if (!ofs) {
+                        cerr << "failed to open output: \"" << opts.output << '"' << endl;
+                        return 1;
+                }
+        }
+
+        ostream& out = ofs.is_open() ? ofs : cout;
+
+        if (opts.output != NULL)
+                emit_header(out);
+
+        if (opts.headless)
+                return run_headless(opts, out);
+
+        capture_t capture(opts.ring_depth, opts.overflow);
+
+        if (!capture.open(opts.input, true)) {
+                CV_Error_(-1, ("failed to open input: \"%s\"", opts.input));
+                exit(1);
+        }
+
         namedWindow(WINDOW_NAME, CV_WINDOW_NORMAL);
         moveWindow(WINDOW_NAME, WINDOW_X_POS, WINDOW_Y_POS);
         resizeWindow(WINDOW_NAME, WINDOW_WIDTH, WINDOW_HEIGHT);
 
         model_t model = {};
+        model.binarize = opts.binarize;
+        model.pyramid_levels = opts.pyramid_levels;
+        model.cascade.adaptive = opts.adaptive_cascade;
+        model.cascade.timed = opts.adaptive_cascade || opts.stats != NULL;
 
         handle_mouse_event(CV_EVENT_LBUTTONDOWN, 407, 476, 0, (void*) &model);
         setMouseCallback(WINDOW_NAME, handle_mouse_event, (void*) &model); 
@@ -734,25 +1495,50 @@ int main(int argc, const char** argv)
         model.canny_threshold = 35;
         createTrackbar("thresh", WINDOW_NAME, &model.canny_threshold, 100);
 
-        Mat scene;
-
-        while (run) {
-                read_frame(vc, scene);
-//                get_selection_contours(model, scene);
-//                find_selection(model, scene);
-                find_key_zero(model, scene);
-                find_zero_tick(model, scene);
-                find_zero_plate_right_edge(model, scene);
-
-                draw_pip(model, scene);
-                draw_selection(model, scene);
-                draw_metrics(scene, vc);
-                draw_match(model, scene);
-                draw_zero_plate_stuff(model, scene);
-
-                compute_interval(model);
-
-                switch (key = waitKey(model.frame_wait)) {
+        // Pipelined, the detect stage owns a model of its own; this one
+        // keeps the selection and the display pacing.
+        spsc_ring<detected_t> ring(opts.ring_depth, OVERFLOW_BLOCK);
+        stage_times_t times = {};
+        model_t detect_model = model;
+        thread detector;
+        model_t* result;
+
+        detected_t item;
+        Mat& scene = item.frame.image;
+        overlay_t overlay;
+        frame_pacer_t pacer(capture.fps());
+        int frame_wait = 1;
+        unsigned frame_num = 0;
+
+        if (opts.pipeline)
+                detector = thread(detect_stage, ref(capture), ref(detect_model),
+                                  ref(ring), ref(times));
+
+        while (run && (result = next_detected(opts.pipeline, capture, model, ring, item)) != NULL) {
+                struct timespec t0 = {}, t1 = {};
+                (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+
+                if (result != &model)
+                        result->selection = model.selection;
+
+                if (opts.output != NULL)
+                        emit_record(out, frame_num, *result);
+                frame_num++;
+
+                // Recorded only; the frame is drawn on just around imshow()
+                overlay.clear();
+                draw_pip(*result, scene, overlay);
+                draw_selection(*result, overlay);
+                draw_metrics(scene, item.frame, overlay);
+                draw_match(*result, overlay);
+                draw_zero_plate_stuff(*result, scene, overlay);
+
+                (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+                times.emit_ms += (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+                frame_wait = pacer.next();
+
+                switch (key = waitKey(frame_wait)) {
                         case 32: //space
                                 pause = !pause; //TODO get this working again
                                 break;
@@ -772,12 +1558,23 @@ int main(int argc, const char** argv)
                         break;
                 }
 
+                overlay.composite(scene);
                 imshow(WINDOW_NAME, scene);
+                overlay.restore(scene);
                 //cout << '.' << flush;
         }
 
-        vc.release();
+        // Unblock the detect stage on either of its queues, then wait for it
+        ring.close();
+        capture.close();
 
-        return 0;
+        if (detector.joinable()) {
+                detector.join();
+                times.frames = frame_num;
+                print_stage_times(cerr, times, 0);
+                return save_cascade_stats(opts, detect_model) ? 0 : 1;
+        }
+
+        return save_cascade_stats(opts, model) ? 0 : 1;
 }
 
@@ -0,0 +1,271 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef FEATURE_CACHE_HPP
+#define FEATURE_CACHE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/features2d/features2d.hpp"
+
+/*
+ * On-disk cache of the keypoints and descriptors of an image, keyed by a
+ * hash of the pixels and of a string describing the detector and its
+ * parameters.
+ *
+ * One file per entry, <dir>/<key>.feat, laid out so that it can be mapped
+ * and used in place:
+ *
+ *      feature_file_header_t
+ *      keypoints               nkeypoints feature_file_keypoint_t
+ *      descriptors             rows * cols * elemSize bytes, row major
+ *
+ * with each section starting on a 64 byte boundary.  On a hit the
+ * descriptor Mat points straight into the mapping, which stays alive for
+ * as long as the entry does.  Entries are written to a temporary file and
+ * renamed into place, so concurrent runs never see a partial file.
+ *
+ * Files are read on the machine that wrote them; the header records the
+ * layout version and the byte order check word, and anything that does
+ * not match is treated as a miss.
+ */
+
+const uint32_t FEATURE_FILE_VERSION = 1;
+const uint32_t FEATURE_FILE_BOM     = 0x01020304;
+
+struct feature_file_header_t {
+        char     magic[8];              // "HGFEAT\0\0"
+        uint32_t version;
+        uint32_t bom;
+        uint64_t key;
+        uint32_t nkeypoints;
+        int32_t  desc_rows;
+        int32_t  desc_cols;
+        int32_t  desc_type;
+        uint64_t keypoints_offset;
+        uint64_t descriptors_offset;
+        uint64_t file_size;
+};
+
+struct feature_file_keypoint_t {
+        float   x, y, size, angle, response;
+        int32_t octave, class_id;
+};
+
+/**
+ * A read-only private mapping of a whole file.
+ */
+class mapped_file_t {
+public:
+        mapped_file_t() : base(NULL), length(0) {}
+
+        ~mapped_file_t()
+        {
+                if (base != NULL)
+                        munmap(base, length);
+        }
+
+        bool open(const std::string& path)
+        {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                struct stat st;
+
+                if (fd < 0)
+                        return false;
+
+                if (fstat(fd, &st) < 0 || st.st_size == 0) {
+                        ::close(fd);
+                        return false;
+                }
+
+                void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+
+                if (p == MAP_FAILED)
+                        return false;
+
+                base = p;
+                length = st.st_size;
+
+                return true;
+        }
+
+        const uint8_t* data() const { return (const uint8_t*) base; }
+        size_t size() const { return length; }
+
+private:
+        mapped_file_t(const mapped_file_t&);
+        mapped_file_t& operator=(const mapped_file_t&);
+
+        void*  base;
+        size_t length;
+};
+
+/**
+ * Keypoints and descriptors of one image, possibly backed by a mapping.
+ */
+struct feature_set_t {
+        std::vector<cv::KeyPoint>       keypoints;
+        cv::Mat                         descriptors;
+        std::shared_ptr<mapped_file_t>  mapping;
+};
+
+/**
+ * FNV-1a, 64 bit.
+ */
+static inline uint64_t fnv1a(const void* data, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
+{
+        const uint8_t* p = (const uint8_t*) data;
+
+        for (size_t i = 0; i < n; i++) {
+                h ^= p[i];
+                h *= 0x100000001b3ULL;
+        }
+
+        return h;
+}
+
+/**
+ * Cache key of image as processed by the detector described by params.
+ */
+static inline uint64_t feature_cache_key(const cv::Mat& image, const std::string& params)
+{
+        int32_t shape[3] = { image.rows, image.cols, image.type() };
+        uint64_t h = fnv1a(&FEATURE_FILE_VERSION, sizeof(FEATURE_FILE_VERSION));
+
+        h = fnv1a(shape, sizeof(shape), h);
+        h = fnv1a(params.data(), params.size(), h);
+
+        for (int y = 0; y < image.rows; y++)
+                h = fnv1a(image.ptr(y), image.cols * image.elemSize(), h);
+
+        return h;
+}
+
+static inline std::string feature_cache_path(const std::string& dir, uint64_t key,
+                const char* suffix)
+{
+        char name[32];
+
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+
+        return dir + "/" + name + suffix;
+}
+
+static inline uint64_t feature_file_align(uint64_t n)
+{
+        return (n + 63) & ~(uint64_t) 63;
+}
+
+/**
+ * Map the entry for key.  Returns false on a miss or an unusable file.
+ */
+static inline bool feature_cache_load(const std::string& dir, uint64_t key, feature_set_t& out)
+{
+        std::shared_ptr<mapped_file_t> file(new mapped_file_t);
+
+        if (!file->open(feature_cache_path(dir, key, ".feat")))
+                return false;
+
+        const uint8_t* base = file->data();
+        feature_file_header_t h;
+
+        if (file->size() < sizeof(h))
+                return false;
+
+        memcpy(&h, base, sizeof(h));
+
+        if (memcmp(h.magic, "HGFEAT\0\0", 8) || h.version != FEATURE_FILE_VERSION ||
+            h.bom != FEATURE_FILE_BOM || h.key != key || h.file_size != file->size())
+                return false;
+
+        const size_t desc_bytes = (size_t) h.desc_rows * h.desc_cols *
+                CV_ELEM_SIZE(h.desc_type);
+
+        if (h.keypoints_offset + h.nkeypoints * sizeof(feature_file_keypoint_t) > h.file_size ||
+            h.descriptors_offset + desc_bytes > h.file_size)
+                return false;
+
+        const feature_file_keypoint_t* kp =
+                (const feature_file_keypoint_t*) (base + h.keypoints_offset);
+
+        out.keypoints.resize(h.nkeypoints);
+        for (uint32_t i = 0; i < h.nkeypoints; i++) {
+                out.keypoints[i] = cv::KeyPoint(cv::Point2f(kp[i].x, kp[i].y), kp[i].size,
+                                kp[i].angle, kp[i].response, kp[i].octave, kp[i].class_id);
+        }
+
+        // The mapping is read only; nothing writes through this Mat.
+        out.descriptors = cv::Mat(h.desc_rows, h.desc_cols, h.desc_type,
+                        (void*) (base + h.descriptors_offset));
+        out.mapping = file;
+
+        return true;
+}
+
+/**
+ * Write the entry for key.  Failures only cost a cache miss next time.
+ */
+static inline bool feature_cache_store(const std::string& dir, uint64_t key,
+                const feature_set_t& in)
+{
+        const cv::Mat& d = in.descriptors;
+        feature_file_header_t h = {};
+
+        memcpy(h.magic, "HGFEAT\0\0", 8);
+        h.version = FEATURE_FILE_VERSION;
+        h.bom = FEATURE_FILE_BOM;
+        h.key = key;
+        h.nkeypoints = in.keypoints.size();
+        h.desc_rows = d.rows;
+        h.desc_cols = d.cols;
+        h.desc_type = d.type();
+        h.keypoints_offset = feature_file_align(sizeof(h));
+        h.descriptors_offset = feature_file_align(h.keypoints_offset +
+                        h.nkeypoints * sizeof(feature_file_keypoint_t));
+        h.file_size = h.descriptors_offset + (uint64_t) d.rows * d.cols * d.elemSize();
+
+        std::vector<uint8_t> buf(h.file_size, 0);
+        memcpy(&buf[0], &h, sizeof(h));
+
+        feature_file_keypoint_t* kp = (feature_file_keypoint_t*) &buf[h.keypoints_offset];
+        for (uint32_t i = 0; i < h.nkeypoints; i++) {
+                const cv::KeyPoint& k = in.keypoints[i];
+                kp[i] = feature_file_keypoint_t { k.pt.x, k.pt.y, k.size, k.angle,
+                        k.response, k.octave, k.class_id };
+        }
+
+        for (int y = 0; y < d.rows; y++) {
+                memcpy(&buf[h.descriptors_offset + (size_t) y * d.cols * d.elemSize()],
+                       d.ptr(y), d.cols * d.elemSize());
+        }
+
+        const std::string path = feature_cache_path(dir, key, ".feat");
+        const std::string tmp = path + ".tmp." + std::to_string(getpid());
+        FILE* f = fopen(tmp.c_str(), "wb");
+
+        if (f == NULL)
+                return false;
+
+        bool ok = fwrite(&buf[0], 1, buf.size(), f) == buf.size();
+        ok = fclose(f) == 0 && ok;
+
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+                unlink(tmp.c_str());
+                return false;
+        }
+
+        return true;
+}
+
+#endif
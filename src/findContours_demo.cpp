@@ -9,6 +9,12 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#include "incremental_canny.hpp"
+#include "threshold_sweep.hpp"
 
 using namespace cv;
 using namespace std;
@@ -16,23 +22,75 @@ using namespace std;
 Mat src; Mat src_gray;
 int thresh = 100;
 int max_thresh = 255;
+double thresh_ratio = 2;
 RNG rng(12345);
 
+/// Gradients and local maxima of src_gray, shared by every threshold
+incremental_canny_t canny;
+
 /// Function header
 void thresh_callback(int, void* );
 
+/**
+ * @function sweep
+ * @brief Evaluate every threshold of the trackbar, print the curve as CSV
+ * and the automatic pick on stderr
+ */
+int sweep( unsigned threads )
+{
+  task_pool_t pool( threads - 1 );
+  vector<sweep_point_t> curve;
+
+  sweep_thresholds( canny, 0, max_thresh, thresh_ratio, pool, curve );
+  write_sweep_csv( stdout, curve );
+
+  const sweep_point_t& knee = curve[ sweep_knee( curve ) ];
+  fprintf( stderr, "-- Knee: thresh %d, %zu contours\n", knee.low, knee.contours );
+
+  return 0;
+}
+
 /**
  * @function main
  */
-int main( int, char** argv )
+int main( int argc, char** argv )
 {
+  bool sweeping = false;
+  unsigned threads = max( 1u, thread::hardware_concurrency() );
+  int argi = 1;
+
+  for( ; argi < argc - 1; argi++ )
+    {
+      if( !strcmp( argv[argi], "--sweep" ) )
+        sweeping = true;
+      else if( !strcmp( argv[argi], "--threads" ) && argi + 2 < argc )
+        threads = max( 1, atoi( argv[++argi] ) );
+      else
+        break;
+    }
+
+  if( argi != argc - 1 )
+    {
+      fprintf( stderr, "usage: %s [--sweep] [--threads n] image\n", argv[0] );
+      return -1;
+    }
+
   /// Load source image and convert it to gray
-  src = imread( argv[1], 1 );
+  src = imread( argv[argi], 1 );
+
+  if( src.empty() )
+    return -1;
 
   /// Convert image to gray and blur it
   cvtColor( src, src_gray, COLOR_BGR2GRAY );
   blur( src_gray, src_gray, Size(3,3) );
 
+  /// Threshold independent part of Canny, once
+  canny.set_image( src_gray );
+
+  if( sweeping )
+    return sweep( threads );
+
   /// Create Window
   const char* source_window = "Source";
   namedWindow( source_window, WINDOW_AUTOSIZE );
@@ -54,8 +112,8 @@ void thresh_callback(int, void* )
   vector<vector<Point> > contours;
   vector<Vec4i> hierarchy;
 
-  /// Detect edges using canny
-  Canny( src_gray, canny_output, thresh, thresh*2, 3 );
+  /// Detect edges using canny; only hysteresis runs again
+  canny.canny( thresh, thresh*thresh_ratio, canny_output );
   /// Find contours
   findContours( canny_output, contours, hierarchy, RETR_TREE, CHAIN_APPROX_SIMPLE, Point(0, 0) );
 
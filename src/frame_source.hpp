@@ -0,0 +1,500 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+/*
+ * Where frames come from, independent of how they are stored:
+ *
+ *      video file              anything cv::VideoCapture opens
+ *      image sequence          a directory of .png/.jpg files, or a glob
+ *                              pattern such as "data/frame*.png", in
+ *                              numeric order
+ *      raw frame file          fixed-stride BGR frames behind a
+ *                              raw_frames_header_t, see below
+ *
+ * open_frame_source() picks the backend from the name and, for plain
+ * files, from the first bytes of the file.
+ */
+
+/** Rate assumed for inputs that do not carry one. */
+const double DEFAULT_FPS = 30;
+
+class frame_source_t {
+public:
+        frame_source_t() : nframes(0), rate(0) {}
+        virtual ~frame_source_t() {}
+
+        /**
+         * The next frame into image, reusing its buffer when the size
+         * matches, and its time in ms from the start of the input.
+         * Returns false at the end of the input.
+         */
+        virtual bool read(cv::Mat& image, double& timestamp) = 0;
+
+        /**
+         * Start over at the first frame.
+         */
+        virtual bool rewind() = 0;
+
+        unsigned count() const { return nframes; }      // 0 if unknown
+        cv::Size size() const { return frame_size; }    // empty if unknown
+        double fps() const { return rate; }
+
+protected:
+        unsigned nframes;
+        cv::Size frame_size;
+        double   rate;
+};
+
+class video_source_t : public frame_source_t {
+public:
+        bool open(const std::string& name)
+        {
+                fname = name;
+
+                if (!vc.open(name))
+                        return false;
+
+                nframes = (unsigned) std::max(0.0, vc.get(CV_CAP_PROP_FRAME_COUNT));
+                frame_size = cv::Size((int) vc.get(CV_CAP_PROP_FRAME_WIDTH),
+                                      (int) vc.get(CV_CAP_PROP_FRAME_HEIGHT));
+                rate = vc.get(CV_CAP_PROP_FPS);
+                if (!(rate > 0))
+                        rate = DEFAULT_FPS;
+                num = 0;
+
+                return true;
+        }
+
+        bool read(cv::Mat& image, double& timestamp)
+        {
+                if (!vc.grab() || !vc.retrieve(image))
+                        return false;
+
+                // Not every backend reports positions
+                timestamp = vc.get(CV_CAP_PROP_POS_MSEC);
+                if (!(timestamp > 0) && num > 0)
+                        timestamp = num * 1000 / rate;
+                num++;
+
+                return true;
+        }
+
+        bool rewind()
+        {
+                // Seeking is unreliable with some codecs; reopening is not
+                vc.release();
+                num = 0;
+                return vc.open(fname);
+        }
+
+private:
+        cv::VideoCapture vc;
+        std::string      fname;
+        unsigned         num;
+};
+
+/**
+ * a < b, comparing runs of digits by value, so "frame9" < "frame10".
+ */
+static inline bool natural_less(const std::string& a, const std::string& b)
+{
+        size_t i = 0, j = 0;
+
+        while (i < a.size() && j < b.size()) {
+                if (isdigit((uchar) a[i]) && isdigit((uchar) b[j])) {
+                        size_t i0 = i, j0 = j;
+
+                        while (i0 < a.size() && a[i0] == '0') i0++;
+                        while (j0 < b.size() && b[j0] == '0') j0++;
+                        for (i = i0; i < a.size() && isdigit((uchar) a[i]); i++);
+                        for (j = j0; j < b.size() && isdigit((uchar) b[j]); j++);
+
+                        if (i - i0 != j - j0)
+                                return i - i0 < j - j0;
+
+                        int c = a.compare(i0, i - i0, b, j0, j - j0);
+                        if (c != 0)
+                                return c < 0;
+                }
+                else {
+                        if (a[i] != b[j])
+                                return a[i] < b[j];
+                        i++, j++;
+                }
+        }
+
+        return a.size() - i < b.size() - j;
+}
+
+class image_sequence_source_t : public frame_source_t {
+public:
+        /**
+         * A directory, taking its .png and .jpg files, or a glob pattern.
+         */
+        bool open(const std::string& name)
+        {
+                struct stat st;
+                std::vector<std::string> patterns;
+
+                if (stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                        for (const char* ext : { "png", "PNG", "jpg", "JPG", "jpeg" })
+                                patterns.push_back(name + "/*." + ext);
+                }
+                else {
+                        patterns.push_back(name);
+                }
+
+                paths.clear();
+
+                for (const std::string& p : patterns) {
+                        glob_t g;
+
+                        if (glob(p.c_str(), 0, NULL, &g) == 0) {
+                                for (size_t i = 0; i < g.gl_pathc; i++)
+                                        paths.push_back(g.gl_pathv[i]);
+                        }
+                        globfree(&g);
+                }
+
+                std::sort(paths.begin(), paths.end(), natural_less);
+
+                if (paths.empty())
+                        return false;
+
+                cv::Mat first = cv::imread(paths[0]);
+
+                if (first.empty())
+                        return false;
+
+                nframes = paths.size();
+                frame_size = first.size();
+                rate = DEFAULT_FPS;
+                next = 0;
+
+                return true;
+        }
+
+        bool read(cv::Mat& image, double& timestamp)
+        {
+                // Skip what does not decode rather than end early
+                while (next < paths.size()) {
+                        timestamp = next * 1000 / rate;
+                        image = cv::imread(paths[next++]);
+
+                        if (!image.empty())
+                                return true;
+                }
+
+                return false;
+        }
+
+        bool rewind()
+        {
+                next = 0;
+                return true;
+        }
+
+private:
+        std::vector<std::string> paths;
+        size_t                   next;
+};
+
+/*
+ * Raw frame file: decoded frames stored back to back, written once by
+ * framecache and then mapped, so that reading one costs nothing.
+ *
+ *      raw_frames_header_t
+ *      frames                  count * frame_stride bytes
+ *
+ * Each frame is height rows of row_stride bytes of 8 bit BGR pixels; the
+ * frames start at frames_offset and every frame starts on a page
+ * boundary.  As with the feature cache, files are read on the machine
+ * that wrote them and a header that does not match is rejected.
+ */
+
+const uint32_t RAW_FRAMES_VERSION = 1;
+const uint32_t RAW_FRAMES_BOM     = 0x01020304;
+const uint64_t RAW_FRAMES_ALIGN   = 4096;
+
+struct raw_frames_header_t {
+        char     magic[8];              // "RAWBGR\0\0"
+        uint32_t version;
+        uint32_t bom;
+        int32_t  width;
+        int32_t  height;
+        uint64_t row_stride;
+        uint64_t frame_stride;
+        uint64_t count;
+        double   fps;
+        uint64_t frames_offset;
+        uint64_t file_size;
+};
+
+static inline uint64_t raw_frames_align(uint64_t n)
+{
+        return (n + RAW_FRAMES_ALIGN - 1) & ~(RAW_FRAMES_ALIGN - 1);
+}
+
+/**
+ * Read and check the header at the start of fd.
+ */
+static inline bool read_raw_frames_header(int fd, raw_frames_header_t& h)
+{
+        struct stat st;
+
+        if (pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h) || fstat(fd, &st) < 0)
+                return false;
+
+        return !memcmp(h.magic, "RAWBGR\0\0", 8) && h.version == RAW_FRAMES_VERSION &&
+               h.bom == RAW_FRAMES_BOM && h.width > 0 && h.height > 0 &&
+               h.row_stride >= (uint64_t) h.width * 3 &&
+               h.frame_stride >= h.row_stride * h.height &&
+               h.file_size == (uint64_t) st.st_size &&
+               h.frames_offset + h.count * h.frame_stride <= h.file_size;
+}
+
+/**
+ * Hands out frames as Mat headers into a private mapping of the file: no
+ * decode and no copy, and a replayed clip comes from the page cache.  The
+ * mapping is writable copy-on-write, so drawing on a frame touches a
+ * private copy of those pages and never the file; the drawing does stay
+ * for the next pass of a loop, unless undone as overlay_t does.  Frames
+ * stay valid until the source is destroyed, which for a capture_t means
+ * until the capture is.
+ */
+class raw_source_t : public frame_source_t {
+public:
+        raw_source_t() : base(NULL), length(0) {}
+
+        ~raw_source_t()
+        {
+                if (base != NULL)
+                        munmap(base, length);
+        }
+
+        bool open(const std::string& name)
+        {
+                int fd = ::open(name.c_str(), O_RDONLY);
+
+                if (fd < 0)
+                        return false;
+
+                if (!read_raw_frames_header(fd, h)) {
+                        ::close(fd);
+                        return false;
+                }
+
+                void* p = mmap(NULL, h.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+
+                if (p == MAP_FAILED)
+                        return false;
+
+                base = (uchar*) p;
+                length = h.file_size;
+
+                nframes = h.count;
+                frame_size = cv::Size(h.width, h.height);
+                rate = h.fps > 0 ? h.fps : DEFAULT_FPS;
+                next = 0;
+
+                return true;
+        }
+
+        bool read(cv::Mat& image, double& timestamp)
+        {
+                if (next >= h.count)
+                        return false;
+
+                // Start paging in the frame after this one
+                if (next + 1 < h.count)
+                        madvise(frame(next + 1), h.frame_stride, MADV_WILLNEED);
+
+                image = cv::Mat(h.height, h.width, CV_8UC3, frame(next), h.row_stride);
+                timestamp = next * 1000 / rate;
+                next++;
+
+                return true;
+        }
+
+        bool rewind()
+        {
+                next = 0;
+                return true;
+        }
+
+private:
+        raw_source_t(const raw_source_t&);
+        raw_source_t& operator=(const raw_source_t&);
+
+        uchar* frame(uint64_t i) const
+        {
+                return base + h.frames_offset + i * h.frame_stride;
+        }
+
+        uchar*              base;
+        size_t              length;
+        raw_frames_header_t h;
+        uint64_t            next;
+};
+
+/**
+ * Writes a raw frame file.  The frames go to a temporary file that close()
+ * renames into place, so readers never see a partial file.
+ */
+class raw_frames_writer_t {
+public:
+        raw_frames_writer_t() : f(NULL) {}
+
+        ~raw_frames_writer_t()
+        {
+                if (f != NULL) {
+                        fclose(f);
+                        unlink(tmp.c_str());
+                }
+        }
+
+        bool open(const std::string& path, cv::Size size, double fps)
+        {
+                this->path = path;
+                tmp = path + ".tmp." + std::to_string(getpid());
+                f = fopen(tmp.c_str(), "wb");
+
+                if (f == NULL)
+                        return false;
+
+                h = raw_frames_header_t();
+                memcpy(h.magic, "RAWBGR\0\0", 8);
+                h.version = RAW_FRAMES_VERSION;
+                h.bom = RAW_FRAMES_BOM;
+                h.width = size.width;
+                h.height = size.height;
+                h.row_stride = (uint64_t) size.width * 3;
+                h.frame_stride = raw_frames_align(h.row_stride * size.height);
+                h.fps = fps;
+                h.frames_offset = raw_frames_align(sizeof(h));
+
+                return true;
+        }
+
+        /**
+         * Append image, a CV_8UC3 frame of the size given to open().
+         */
+        bool write(const cv::Mat& image)
+        {
+                if (f == NULL || image.type() != CV_8UC3 ||
+                    image.cols != h.width || image.rows != h.height)
+                        return false;
+
+                if (fseeko(f, h.frames_offset + h.count * h.frame_stride, SEEK_SET) != 0)
+                        return false;
+
+                for (int y = 0; y < image.rows; y++) {
+                        if (fwrite(image.ptr(y), 1, h.row_stride, f) != h.row_stride)
+                                return false;
+                }
+
+                h.count++;
+
+                return true;
+        }
+
+        /**
+         * Write the header and move the file into place.
+         */
+        bool close()
+        {
+                if (f == NULL)
+                        return false;
+
+                h.file_size = h.frames_offset + h.count * h.frame_stride;
+
+                bool ok = fflush(f) == 0 && ftruncate(fileno(f), h.file_size) == 0 &&
+                          fseeko(f, 0, SEEK_SET) == 0 &&
+                          fwrite(&h, sizeof(h), 1, f) == 1;
+                ok = fclose(f) == 0 && ok;
+                f = NULL;
+
+                if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+                        unlink(tmp.c_str());
+                        return false;
+                }
+
+                return true;
+        }
+
+        uint64_t count() const { return h.count; }
+
+private:
+        raw_frames_writer_t(const raw_frames_writer_t&);
+        raw_frames_writer_t& operator=(const raw_frames_writer_t&);
+
+        FILE*               f;
+        std::string         path, tmp;
+        raw_frames_header_t h;
+};
+
+/**
+ * The backend for name, opened, or NULL when it cannot be read.
+ */
+static inline std::unique_ptr<frame_source_t> open_frame_source(const std::string& name)
+{
+        struct stat st;
+        const bool exists = stat(name.c_str(), &st) == 0;
+        const bool is_file = exists && S_ISREG(st.st_mode);
+
+        if (exists ? S_ISDIR(st.st_mode) : name.find_first_of("*?[") != std::string::npos) {
+                std::unique_ptr<image_sequence_source_t> seq(new image_sequence_source_t);
+
+                if (seq->open(name))
+                        return std::move(seq);
+                return NULL;
+        }
+
+        if (is_file) {
+                char magic[8] = {};
+                int fd = ::open(name.c_str(), O_RDONLY);
+
+                if (fd >= 0) {
+                        bool raw = pread(fd, magic, 8, 0) == 8 && !memcmp(magic, "RAWBGR\0\0", 8);
+                        ::close(fd);
+
+                        if (raw) {
+                                std::unique_ptr<raw_source_t> src(new raw_source_t);
+
+                                if (src->open(name))
+                                        return std::move(src);
+                                return NULL;
+                        }
+                }
+        }
+
+        std::unique_ptr<video_source_t> video(new video_source_t);
+
+        if (video->open(name))
+                return std::move(video);
+
+        return NULL;
+}
+
+#endif
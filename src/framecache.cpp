@@ -0,0 +1,115 @@
+/* vim: set ts=8 sw=8 et : */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+#include "frame_source.hpp"
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Decode an input once into a raw frame file, so that benchmarks and long
+ * replays read mapped pixels instead of paying for the decoder on every
+ * pass.  Any input the programs take works, a raw frame file included.
+ */
+
+static void usage(const char* prog)
+{
+        cerr << "usage: " << prog << " [--frames n] input output" << endl
+             << endl
+             << "  input       video file, image directory or pattern, or raw frame"
+                " file" << endl
+             << "  output      raw frame file to write" << endl
+             << "  --frames n  stop after n frames (default: the whole input)" << endl;
+}
+
+int main(int argc, const char** argv)
+{
+        const char* input = NULL;
+        const char* output = NULL;
+        unsigned max_frames = 0;
+
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+                        max_frames = atoi(argv[++i]);
+                }
+                else if (argv[i][0] == '-' && argv[i][1] == '-') {
+                        usage(argv[0]);
+                        return 1;
+                }
+                else if (input == NULL) {
+                        input = argv[i];
+                }
+                else if (output == NULL) {
+                        output = argv[i];
+                }
+                else {
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if (output == NULL) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        unique_ptr<frame_source_t> source = open_frame_source(input);
+
+        if (!source) {
+                cerr << "failed to open input: \"" << input << '"' << endl;
+                return 1;
+        }
+
+        struct timespec t0 = {}, t1 = {};
+        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        raw_frames_writer_t writer;
+        Mat image;
+        double timestamp;
+
+        while ((max_frames == 0 || writer.count() < max_frames) &&
+               source->read(image, timestamp)) {
+                if (writer.count() == 0 && !writer.open(output, image.size(), source->fps())) {
+                        cerr << "failed to create output: \"" << output << '"' << endl;
+                        return 1;
+                }
+
+                if (!writer.write(image)) {
+                        cerr << "failed to write frame " << writer.count() << " ("
+                             << image.cols << 'x' << image.rows << ", type "
+                             << image.type() << ") to \"" << output << '"' << endl;
+                        return 1;
+                }
+        }
+
+        uint64_t frames = writer.count();
+
+        if (frames == 0) {
+                cerr << "no frames in input: \"" << input << '"' << endl;
+                return 1;
+        }
+
+        if (!writer.close()) {
+                cerr << "failed to write output: \"" << output << '"' << endl;
+                return 1;
+        }
+
+        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+        cerr << frames << " frames of " << image.cols << 'x' << image.rows
+             << " at " << source->fps() << " fps, "
+             << (double) frames * raw_frames_align((uint64_t) image.cols * 3 * image.rows) / (1 << 20)
+             << " MiB, decoded in " << secs << " s" << endl;
+
+        return 0;
+}
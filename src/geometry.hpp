@@ -0,0 +1,100 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef GEOMETRY_HPP
+#define GEOMETRY_HPP
+
+#include <cmath>
+#include <cstddef>
+
+#include "opencv2/core/core.hpp"
+
+/*
+ * RotatedRect helpers for the per-contour tests.  Everything is worked out
+ * from the rect's size and angle, so there is no call to points(), no heap
+ * allocation and, apart from the one conversion to radians, no trig.
+ *
+ * RotatedRect::points() puts the edge 0->1 along angle - 90 degrees with
+ * length size.height and the edge 0->3 along angle with length size.width,
+ * which is where the major axis orientation below comes from.
+ */
+
+/**
+ * Aspect ratio of a RotatedRect, where the major axis is the height,
+ * regardless of orientation.
+ */
+static inline float rr_aspect_ratio(const cv::RotatedRect& r)
+{
+        float w = r.size.width, h = r.size.height;
+
+        return w > h ? w / h : h / w;
+}
+
+/**
+ * Orientation of the major axis of a RotatedRect in degrees, in the same
+ * frame as RotatedRect::angle.  Square rects take the width edge.
+ */
+static inline float rr_major_axis_angle(const cv::RotatedRect& r)
+{
+        return r.size.height > r.size.width ? r.angle - 90 : r.angle;
+}
+
+/**
+ * Difference of two orientations in degrees, wrapped to [0, 180].
+ */
+static inline float angle_delta_deg(float a1, float a2)
+{
+        return fabsf(remainderf(a1 - a2, 360.f));
+}
+
+/**
+ * Angle in radians between the major axes of two RotatedRects, in [0, pi].
+ */
+static inline float rr_major_axis_delta(const cv::RotatedRect& r1, const cv::RotatedRect& r2)
+{
+        return angle_delta_deg(rr_major_axis_angle(r1), rr_major_axis_angle(r2)) *
+                (float) (CV_PI / 180);
+}
+
+/**
+ * Whether the major axes of two RotatedRects are no more than max_delta
+ * radians apart, comparing in degrees so nothing is converted per call.
+ */
+static inline bool rr_major_axes_within(const cv::RotatedRect& r1, const cv::RotatedRect& r2,
+                float max_delta)
+{
+        return angle_delta_deg(rr_major_axis_angle(r1), rr_major_axis_angle(r2)) <=
+                max_delta * (float) (180 / CV_PI);
+}
+
+/**
+ * Whether two points are no more than max_dist apart, by squared distance.
+ */
+static inline bool points_within(const cv::Point2f& p1, const cv::Point2f& p2, float max_dist)
+{
+        float dx = p1.x - p2.x, dy = p1.y - p2.y;
+
+        return dx * dx + dy * dy <= max_dist * max_dist;
+}
+
+/**
+ * Batch variants: the aspect ratio of n rects, and the major axis delta of
+ * each of n rects against ref.  The loops carry no dependencies, so the
+ * compiler is free to vectorize them.
+ */
+static inline void rr_aspect_ratios(const cv::RotatedRect* rects, size_t n, float* out)
+{
+        for (size_t i = 0; i < n; i++)
+                out[i] = rr_aspect_ratio(rects[i]);
+}
+
+static inline void rr_major_axis_deltas(const cv::RotatedRect& ref,
+                const cv::RotatedRect* rects, size_t n, float* out)
+{
+        const float ref_angle = rr_major_axis_angle(ref);
+
+        for (size_t i = 0; i < n; i++)
+                out[i] = angle_delta_deg(rr_major_axis_angle(rects[i]), ref_angle) *
+                        (float) (CV_PI / 180);
+}
+
+#endif
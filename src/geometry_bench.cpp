@@ -0,0 +1,240 @@
+/* vim: set ts=8 sw=8 et : */
+
+/*
+ * Check the geometry.hpp RotatedRect helpers against the original
+ * points()/cartToPolar() implementations, then time both.
+ *
+ *      geometry_bench [rects [rounds]]
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "geometry.hpp"
+
+using namespace cv;
+using namespace std;
+
+// cartToPolar() computes angles with fastAtan2(), good to about 0.3 degrees
+const float       ANGLE_TOLERANCE     = 0.01;
+const float       RATIO_TOLERANCE     = 1e-4;
+const float       AXIS_THRESHOLD      = 0.1;
+
+// Rects closer to square than this have no well defined major axis
+const float       MIN_AXIS_DIFFERENCE = 0.01;
+
+/**
+ * The original implementation, from edges.cpp
+ */
+static float ref_major_axis_delta(const RotatedRect& r1, const RotatedRect& r2)
+{
+        Point2f verts[4];
+        Point2f axis1, axis2;
+        vector<float> x, y, mag, ng;
+        float ng1, ng2;
+
+        r1.points(verts);
+        axis1 = verts[1] - verts[0];
+        axis2 = verts[3] - verts[0];
+        x = { axis1.x, axis2.x };
+        y = { axis1.y, axis2.y };
+        cartToPolar(x, y, mag, ng);
+        ng1 = ng[mag[0] > mag[1] ? 0 : 1] - M_PI;
+
+        r2.points(verts);
+        axis1 = verts[1] - verts[0];
+        axis2 = verts[3] - verts[0];
+        x = { axis1.x, axis2.x };
+        y = { axis1.y, axis2.y };
+        cartToPolar(x, y, mag, ng);
+        ng2 = ng[mag[0] > mag[1] ? 0 : 1] - M_PI;
+
+        return abs(atan2(sin(ng1 - ng2), cos(ng1 - ng2)));
+}
+
+/**
+ * The original implementation, from edges.cpp
+ */
+static float ref_aspect_ratio(const RotatedRect& r)
+{
+        Point2f verts[4];
+        Point2f axis1, axis2;
+        vector<float> x, y, mag;
+
+        r.points(verts);
+        axis1 = verts[1] - verts[0];
+        axis2 = verts[3] - verts[0];
+        x = { axis1.x, axis2.x };
+        y = { axis1.y, axis2.y };
+        magnitude(x, y, mag);
+
+        float height = max(mag[0], mag[1]);
+        float width  = min(mag[0], mag[1]);
+
+        return height / width;
+}
+
+static double now_ms()
+{
+        struct timespec ts = {};
+        (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static vector<RotatedRect> random_rects(RNG& rng, unsigned n)
+{
+        vector<RotatedRect> rects;
+
+        while (rects.size() < n) {
+                Size2f size(rng.uniform(2.0, 200.0), rng.uniform(2.0, 200.0));
+
+                if (fabs(size.width - size.height) < MIN_AXIS_DIFFERENCE * max(size.width, size.height))
+                        continue;
+
+                rects.push_back(RotatedRect(Point2f(rng.uniform(0.0, 1000.0),
+                                                    rng.uniform(0.0, 1000.0)),
+                                            size, rng.uniform(-180.0, 180.0)));
+        }
+
+        return rects;
+}
+
+/**
+ * Compare every helper with the reference; returns the number of mismatches.
+ */
+static unsigned check(const vector<RotatedRect>& rects)
+{
+        const size_t n = rects.size();
+        vector<float> ratios(n), deltas(n);
+        unsigned bad = 0;
+
+        rr_aspect_ratios(&rects[0], n, &ratios[0]);
+        rr_major_axis_deltas(rects[0], &rects[0], n, &deltas[0]);
+
+        for (size_t i = 0; i < n; i++) {
+                const RotatedRect& a = rects[i];
+                const RotatedRect& b = rects[(i + 1) % n];
+
+                float ref_ratio = ref_aspect_ratio(a);
+                float ref_delta = ref_major_axis_delta(a, b);
+                float delta = rr_major_axis_delta(a, b);
+
+                if (fabs(rr_aspect_ratio(a) - ref_ratio) > RATIO_TOLERANCE * ref_ratio ||
+                    ratios[i] != rr_aspect_ratio(a)) {
+                        printf("aspect ratio %zu: %g, reference %g\n", i, rr_aspect_ratio(a), ref_ratio);
+                        bad++;
+                }
+
+                if (fabs(delta - ref_delta) > ANGLE_TOLERANCE) {
+                        printf("axis delta %zu: %g, reference %g\n", i, delta, ref_delta);
+                        bad++;
+                }
+
+                if (fabs(deltas[i] - ref_major_axis_delta(a, rects[0])) > ANGLE_TOLERANCE) {
+                        printf("batch axis delta %zu: %g\n", i, deltas[i]);
+                        bad++;
+                }
+
+                // Away from the threshold the test must agree exactly
+                if (fabs(ref_delta - AXIS_THRESHOLD) > ANGLE_TOLERANCE &&
+                    rr_major_axes_within(a, b, AXIS_THRESHOLD) != (ref_delta <= AXIS_THRESHOLD)) {
+                        printf("axis threshold %zu: reference delta %g\n", i, ref_delta);
+                        bad++;
+                }
+
+                Point2f d = a.center - b.center;
+                float dist = a.size.height * 0.1f;
+                bool ref_within = sqrt(pow(d.x, 2) + pow(d.y, 2)) <= dist;
+
+                if (fabs(sqrt(d.x * d.x + d.y * d.y) - dist) > 1e-3 &&
+                    points_within(a.center, b.center, dist) != ref_within) {
+                        printf("center distance %zu\n", i);
+                        bad++;
+                }
+        }
+
+        return bad;
+}
+
+int main(int argc, const char** argv)
+{
+        const unsigned nrects = argc > 1 ? atoi(argv[1]) : 10000;
+        const unsigned rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+        RNG rng(12345);
+        vector<RotatedRect> rects = random_rects(rng, nrects < 2 ? 2 : nrects);
+        const size_t n = rects.size();
+
+        unsigned bad = check(rects);
+
+        printf("%zu rects, %u mismatches\n", n, bad);
+
+        if (bad)
+                return 1;
+
+        // The sums keep the loops from being optimized away
+        vector<float> out(n);
+        double sum = 0, t0, ms;
+        const double calls = (double) n * rounds;
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++)
+                for (size_t i = 0; i < n; i++)
+                        sum += ref_aspect_ratio(rects[i]);
+        ms = now_ms() - t0;
+        printf("reference aspect ratio   %8.2f ns/rect\n", ms * 1e6 / calls);
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++)
+                for (size_t i = 0; i < n; i++)
+                        sum += rr_aspect_ratio(rects[i]);
+        ms = now_ms() - t0;
+        printf("rr_aspect_ratio          %8.2f ns/rect\n", ms * 1e6 / calls);
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++) {
+                rr_aspect_ratios(&rects[0], n, &out[0]);
+                sum += out[r % n];
+        }
+        ms = now_ms() - t0;
+        printf("rr_aspect_ratios         %8.2f ns/rect\n", ms * 1e6 / calls);
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++)
+                for (size_t i = 1; i < n; i++)
+                        sum += ref_major_axis_delta(rects[i - 1], rects[i]);
+        ms = now_ms() - t0;
+        printf("reference axis delta     %8.2f ns/pair\n", ms * 1e6 / calls);
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++)
+                for (size_t i = 1; i < n; i++)
+                        sum += rr_major_axis_delta(rects[i - 1], rects[i]);
+        ms = now_ms() - t0;
+        printf("rr_major_axis_delta      %8.2f ns/pair\n", ms * 1e6 / calls);
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++)
+                for (size_t i = 1; i < n; i++)
+                        sum += rr_major_axes_within(rects[i - 1], rects[i], AXIS_THRESHOLD);
+        ms = now_ms() - t0;
+        printf("rr_major_axes_within     %8.2f ns/pair\n", ms * 1e6 / calls);
+
+        t0 = now_ms();
+        for (unsigned r = 0; r < rounds; r++) {
+                rr_major_axis_deltas(rects[r % n], &rects[0], n, &out[0]);
+                sum += out[r % n];
+        }
+        ms = now_ms() - t0;
+        printf("rr_major_axis_deltas     %8.2f ns/pair\n", ms * 1e6 / calls);
+
+        printf("(checksum %g)\n", sum);
+
+        return 0;
+}
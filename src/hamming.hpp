@@ -0,0 +1,123 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef HAMMING_HPP
+#define HAMMING_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__POPCNT__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/features2d/features2d.hpp"
+
+/**
+ * Brute-force nearest neighbours of binary descriptors (ORB, BRISK) under
+ * the Hamming distance.
+ *
+ * Rows of 32 bytes or less are counted eight bytes at a time with POPCNT.
+ * Longer rows that are a multiple of 32 bytes use AVX2: the XOR is split
+ * into nibbles, each nibble counted with a 16 entry table lookup (pshufb)
+ * and the byte counts summed into 64 bit lanes with psadbw, which only
+ * pays off once there are several vectors per row.
+ */
+
+static inline unsigned hamming_popcnt(const uint8_t* a, const uint8_t* b, int n)
+{
+        unsigned d = 0;
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+                uint64_t x, y;
+                memcpy(&x, a + i, 8);
+                memcpy(&y, b + i, 8);
+#if defined(__POPCNT__)
+                d += _mm_popcnt_u64(x ^ y);
+#else
+                d += __builtin_popcountll(x ^ y);
+#endif
+        }
+
+        for (; i < n; i++)
+                d += __builtin_popcount(a[i] ^ b[i]);
+
+        return d;
+}
+
+#if defined(__AVX2__)
+static inline unsigned hamming_avx2(const uint8_t* a, const uint8_t* b, int n)
+{
+        const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                               0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        __m256i acc = _mm256_setzero_si256();
+
+        for (int i = 0; i < n; i += 32) {
+                __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i)),
+                                             _mm256_loadu_si256((const __m256i*) (b + i)));
+                __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low));
+                __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+
+                // At most 8 per byte, so the add cannot overflow
+                acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi),
+                                                            _mm256_setzero_si256()));
+        }
+
+        __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+        return (unsigned) (_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+}
+#endif
+
+static inline unsigned hamming_distance(const uint8_t* a, const uint8_t* b, int n)
+{
+#if defined(__AVX2__)
+        if (n > 32 && n % 32 == 0)
+                return hamming_avx2(a, b, n);
+#endif
+        return hamming_popcnt(a, b, n);
+}
+
+/**
+ * For every row of query, the two nearest rows of train: best[i] and
+ * second[i] with trainIdx set, or trainIdx -1 when train has fewer rows.
+ * Both Mats are CV_8U with the same number of columns.
+ */
+static inline void hamming_knn2(const cv::Mat& query, const cv::Mat& train,
+                std::vector<cv::DMatch>& best, std::vector<cv::DMatch>& second)
+{
+        const int n = query.cols;
+
+        CV_Assert(query.type() == CV_8U && train.type() == CV_8U && train.cols == n);
+
+        best.resize(query.rows);
+        second.resize(query.rows);
+
+        for (int i = 0; i < query.rows; i++) {
+                const uint8_t* q = query.ptr<uint8_t>(i);
+                unsigned d1 = UINT32_MAX, d2 = UINT32_MAX;
+                int j1 = -1, j2 = -1;
+
+                for (int j = 0; j < train.rows; j++) {
+                        unsigned d = hamming_distance(q, train.ptr<uint8_t>(j), n);
+
+                        if (d < d2) {
+                                if (d < d1) {
+                                        d2 = d1, j2 = j1;
+                                        d1 = d, j1 = j;
+                                }
+                                else {
+                                        d2 = d, j2 = j;
+                                }
+                        }
+                }
+
+                best[i] = cv::DMatch(i, j1, (float) d1);
+                second[i] = cv::DMatch(i, j2, (float) d2);
+        }
+}
+
+#endif
@@ -1,112 +1,962 @@
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "opencv2/opencv_modules.hpp"
 #include "opencv2/core/core.hpp"
 #include "opencv2/features2d/features2d.hpp"
+#include "opencv2/flann/flann.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/video/tracking.hpp"
+#ifdef HAVE_OPENCV_NONFREE
 #include "opencv2/nonfree/nonfree.hpp"
+#endif
+
+#include "feature_cache.hpp"
+#include "hamming.hpp"
+#include "task_pool.hpp"
 
 using namespace cv;
 
+const int MIN_HESSIAN = 400;
+const int ORB_FEATURES = 1000;
+const int BRISK_THRESHOLD = 30;
+const int KDTREES = 4;
+const int FLANN_CHECKS = 32;
+
+// Lowe's ratio test: keep a match only if it is clearly better than the
+// second nearest needle descriptor
+const float MATCH_RATIO = 0.8;
+
+// Haystacks in flight per pool thread in batch mode
+const unsigned BATCH_DEPTH = 4;
+
+// Tracking mode: pyramidal Lucas-Kanade parameters, and when the tracked
+// homography has drifted far enough to detect and match again
+const Size LK_WINDOW( 21, 21 );
+const int LK_LEVELS = 3;
+const unsigned MIN_TRACKED_POINTS = 8;
+const double MIN_INLIER_RATIO = 0.5;         // of the inliers of the last detection
+const double MAX_REPROJECTION_ERROR = 2.0;   // mean over the followed points, pixels
+
 void readme();
 
-/** @function main */
-int main( int argc, char** argv )
+/**
+ * A detector/descriptor and how its descriptors are matched: float
+ * descriptors through a FLANN kd-tree index, binary ones by brute force
+ * Hamming distance (hamming.hpp).
+ */
+struct feature_backend_t
+{
+    const char* name;
+    bool binary;
+    Ptr<Feature2D> (*create)();
+};
+
+#ifdef HAVE_OPENCV_NONFREE
+static Ptr<Feature2D> create_surf() { return new SURF( MIN_HESSIAN ); }
+#endif
+static Ptr<Feature2D> create_orb() { return new ORB( ORB_FEATURES ); }
+static Ptr<Feature2D> create_brisk() { return new BRISK( BRISK_THRESHOLD ); }
+
+// The first one is the default
+static const feature_backend_t BACKENDS[] = {
+#ifdef HAVE_OPENCV_NONFREE
+    { "surf",  false, create_surf },
+#endif
+    { "orb",   true,  create_orb },
+    { "brisk", true,  create_brisk },
+};
+
+/** The trained needle */
+struct needle_t
+{
+    const feature_backend_t* backend;
+    Size size;
+    feature_set_t features;
+    flann::Index index;         // float descriptors only
+};
+
+/** Milliseconds spent in each stage on one haystack */
+struct stage_times_t
+{
+    double detect, describe, match, ransac, track;
+};
+
+/** @function lap_ms: milliseconds since t, then t = now */
+static double lap_ms( int64& t )
+{
+    int64 now = getTickCount();
+    double ms = (now - t) * 1000. / getTickFrequency();
+
+    t = now;
+    return ms;
+}
+
+/** @function detect_features */
+static void detect_features( const feature_backend_t& backend, const Mat& img,
+                             feature_set_t& features, stage_times_t* times = NULL )
+{
+    // Batch workers each get their own, nothing is shared between threads
+    static thread_local Ptr<Feature2D> detector;
+
+    if( detector.empty() )
+        detector = backend.create();
+
+    int64 t = getTickCount();
+
+    //-- Step 1: Detect the keypoints
+    detector->detect( img, features.keypoints );
+
+    if( times )
+        times->detect = lap_ms( t );
+
+    //-- Step 2: Calculate descriptors (feature vectors)
+    detector->compute( img, features.keypoints, features.descriptors );
+
+    if( times )
+        times->describe = lap_ms( t );
+}
+
+/** @function append_params: name and every parameter of algorithm, as read back */
+static void append_params( std::ostringstream& params, const Algorithm& algorithm )
 {
-    if( argc != 3 )
+    std::vector< std::string > names;
+
+    params << " " << algorithm.name();
+
+    algorithm.getParams( names );
+    for( size_t i = 0; i < names.size(); i++ )
     {
-        readme();
-        return -1;
+        params << " " << names[i] << "=";
+
+        switch( algorithm.paramType( names[i] ) )
+        {
+        case Param::STRING:
+            params << algorithm.getString( names[i] );
+            break;
+        case Param::MAT:
+        case Param::MAT_VECTOR:
+        case Param::ALGORITHM:
+            params << "?";
+            break;
+        default:
+            // Every numeric type reads back as a double
+            params << algorithm.getDouble( names[i] );
+            break;
+        }
     }
+}
+
+/**
+ * @function feature_params
+ *
+ * Everything that changes the cached keypoints, descriptors or index: the
+ * OpenCV build, every parameter of the detector as created, and the
+ * kd-tree count for float descriptors.
+ */
+static std::string feature_params( const feature_backend_t& backend )
+{
+    std::ostringstream params;
 
-    Mat img_object = imread( argv[1], CV_LOAD_IMAGE_GRAYSCALE );
-    Mat img_scene = imread( argv[2], CV_LOAD_IMAGE_GRAYSCALE );
+    params << std::setprecision( 17 ) << "opencv=" << CV_VERSION;
+    append_params( params, *backend.create() );
+    if( !backend.binary )
+        params << " kdtree=" << KDTREES;
+
+    return params.str();
+}
 
-    if( !img_object.data || !img_scene.data )
+/**
+ * @function load_needle
+ *
+ * Features of the needle and, for float descriptors, the FLANN index over
+ * them.  With a cache directory both come from disk when the same image
+ * was seen before with the same backend and parameters, and are stored
+ * there otherwise.
+ */
+static bool load_needle( const Mat& img, const char* cache_dir, needle_t& needle )
+{
+    const feature_backend_t& backend = *needle.backend;
+    const flann::KDTreeIndexParams index_params( KDTREES );
+    feature_set_t& features = needle.features;
+    flann::Index& index = needle.index;
+
+    needle.size = img.size();
+
+    if( cache_dir == NULL )
     {
-        std::cout<< " --(!) Error reading images " << std::endl;
-        return -1;
+        detect_features( backend, img, features );
+        if( !backend.binary )
+            index.build( features.descriptors, index_params );
+        return false;
     }
 
-    //-- Step 1: Detect the keypoints using SURF Detector
-    int minHessian = 400;
+    if( mkdir( cache_dir, 0777 ) != 0 && errno != EEXIST )
+        std::cout << " --(!) Cannot create cache directory " << cache_dir << std::endl;
 
-    SurfFeatureDetector detector( minHessian );
+    uint64_t key = feature_cache_key( img, feature_params( backend ) );
+    std::string index_path = feature_cache_path( cache_dir, key, ".flann" );
 
-    std::vector<KeyPoint> keypoints_object, keypoints_scene;
+    if( feature_cache_load( cache_dir, key, features ) &&
+        features.descriptors.rows > 0 &&
+        (backend.binary || index.load( features.descriptors, index_path )) )
+        return true;
 
-    detector.detect( img_object, keypoints_object );
-    detector.detect( img_scene, keypoints_scene );
+    detect_features( backend, img, features );
+    feature_cache_store( cache_dir, key, features );
 
-    //-- Step 2: Calculate descriptors (feature vectors)
-    SurfDescriptorExtractor extractor;
+    if( backend.binary )
+        return false;
 
-    Mat descriptors_object, descriptors_scene;
+    index.build( features.descriptors, index_params );
 
-    extractor.compute( img_object, keypoints_object, descriptors_object );
-    extractor.compute( img_scene, keypoints_scene, descriptors_scene );
+    std::string tmp = index_path + ".tmp." + std::to_string( getpid() );
+    index.save( tmp );
+    if( rename( tmp.c_str(), index_path.c_str() ) != 0 )
+        unlink( tmp.c_str() );
 
-    //-- Step 3: Matching descriptor vectors using FLANN matcher
-    FlannBasedMatcher matcher;
-    std::vector< DMatch > matches;
-    matcher.match( descriptors_object, descriptors_scene, matches );
+    return false;
+}
 
-    double max_dist = 0;
-    double min_dist = 100;
+/**
+ * @function match_features
+ *
+ * Nearest and second nearest needle descriptor for every scene descriptor;
+ * matches gets every nearest one, good_matches those that pass the ratio
+ * test.  The needle does not change between runs, so the query side is
+ * the scene; queryIdx/trainIdx still refer to needle/scene keypoints.
+ * Searching does not modify the index, so batch workers share one.
+ */
+static void match_features( needle_t& needle, const Mat& descriptors_scene,
+                            std::vector< DMatch >& matches, std::vector< DMatch >& good_matches )
+{
+    std::vector< DMatch > best, second;
 
-    //-- Quick calculation of max and min distances between keypoints
-    for( int i = 0; i < descriptors_object.rows; i++ )
-    {   double dist = matches[i].distance;
-        if( dist < min_dist ) min_dist = dist;
-        if( dist > max_dist ) max_dist = dist;
-    }
+    matches.clear();
+    good_matches.clear();
 
-    printf("-- Max dist : %f \n", max_dist );
-    printf("-- Min dist : %f \n", min_dist );
+    if( descriptors_scene.rows == 0 || needle.features.descriptors.rows == 0 )
+        return;
 
-    //-- Draw only "good" matches (i.e. whose distance is less than 3*min_dist )
-    std::vector< DMatch > good_matches;
+    if( needle.backend->binary )
+        hamming_knn2( descriptors_scene, needle.features.descriptors, best, second );
+    else
+    {
+        const int k = std::min( 2, needle.features.descriptors.rows );
+        Mat indices, dists;
+
+        needle.index.knnSearch( descriptors_scene, indices, dists, k, flann::SearchParams( FLANN_CHECKS ) );
 
-    for( int i = 0; i < descriptors_object.rows; i++ )
-    {   if( matches[i].distance < 3*min_dist )
+        // FLANN reports squared L2 distances
+        for( int i = 0; i < descriptors_scene.rows; i++ )
         {
-            good_matches.push_back( matches[i]);
+            best.push_back( DMatch( i, indices.at<int>(i, 0), sqrt( dists.at<float>(i, 0) ) ) );
+            second.push_back( k < 2 ? DMatch( i, -1, 0 ) :
+                              DMatch( i, indices.at<int>(i, 1), sqrt( dists.at<float>(i, 1) ) ) );
         }
     }
 
-    Mat img_matches;
-    drawMatches( img_object, keypoints_object, img_scene, keypoints_scene,
-                 good_matches, img_matches, Scalar::all(-1), Scalar::all(-1),
-                 vector<char>(), DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS );
+    for( int i = 0; i < descriptors_scene.rows; i++ )
+    {
+        DMatch m( best[i].trainIdx, i, best[i].distance );
+
+        matches.push_back( m );
+        if( second[i].trainIdx < 0 || m.distance < MATCH_RATIO * second[i].distance )
+            good_matches.push_back( m );
+    }
+}
+
+/** Where the needle was found in one haystack */
+struct location_t
+{
+    feature_set_t scene;
+    std::vector< DMatch > good_matches;
+    double min_dist, max_dist;
+    unsigned points;            // correspondences given to findHomography()
+    Mat H;
+    std::vector<uchar> mask;    // RANSAC inliers among them
+    int inliers;
+    std::vector<Point2f> scene_corners;
+    stage_times_t times;
+};
+
+/** @function project_corners: the needle outline in the scene, through loc.H */
+static void project_corners( const needle_t& needle, location_t& loc )
+{
+    //-- Get the corners from the image_1 ( the object to be "detected" )
+    std::vector<Point2f> obj_corners(4);
+    obj_corners[0] = cvPoint(0,0);
+    obj_corners[1] = cvPoint( needle.size.width, 0 );
+    obj_corners[2] = cvPoint( needle.size.width, needle.size.height );
+    obj_corners[3] = cvPoint( 0, needle.size.height );
+    loc.scene_corners.resize(4);
+
+    perspectiveTransform( obj_corners, loc.scene_corners, loc.H);
+}
+
+/**
+ * @function locate
+ *
+ * Match the scene against the needle and fit the homography.  Returns
+ * false when there are too few good matches or no homography was found.
+ */
+static bool locate( const Mat& img_scene, needle_t& needle, location_t& loc )
+{
+    const std::vector<KeyPoint>& keypoints_object = needle.features.keypoints;
+    const std::vector<KeyPoint>& keypoints_scene = loc.scene.keypoints;
+
+    loc.points = 0;
+    loc.H = Mat();
+    loc.mask.clear();
+    loc.inliers = 0;
+    loc.scene_corners.clear();
+    loc.times = stage_times_t();
+
+    detect_features( *needle.backend, img_scene, loc.scene, &loc.times );
+
+    //-- Step 3: Matching descriptor vectors
+    std::vector< DMatch > matches;
+    int64 t = getTickCount();
+
+    match_features( needle, loc.scene.descriptors, matches, loc.good_matches );
+    loc.times.match = lap_ms( t );
+
+    loc.max_dist = 0;
+    loc.min_dist = matches.empty() ? 0 : matches[0].distance;
+
+    //-- Quick calculation of max and min distances between keypoints
+    for( unsigned i = 0; i < matches.size(); i++ )
+    {   double dist = matches[i].distance;
+        if( dist < loc.min_dist ) loc.min_dist = dist;
+        if( dist > loc.max_dist ) loc.max_dist = dist;
+    }
+
+    // findHomography() needs four correspondences
+    if( loc.good_matches.size() < 4 )
+        return false;
 
     //-- Localize the object
     std::vector<Point2f> obj;
     std::vector<Point2f> scene;
 
-    for( unsigned i = 0; i < good_matches.size(); i++ )
+    for( unsigned i = 0; i < loc.good_matches.size(); i++ )
     {
         //-- Get the keypoints from the good matches
-        obj.push_back( keypoints_object[ good_matches[i].queryIdx ].pt );
-        scene.push_back( keypoints_scene[ good_matches[i].trainIdx ].pt );
+        obj.push_back( keypoints_object[ loc.good_matches[i].queryIdx ].pt );
+        scene.push_back( keypoints_scene[ loc.good_matches[i].trainIdx ].pt );
     }
 
-    Mat H = findHomography( obj, scene, CV_RANSAC );
+    loc.points = obj.size();
+    loc.H = findHomography( obj, scene, CV_RANSAC, 3, loc.mask );
+    loc.times.ransac = lap_ms( t );
 
-    //-- Get the corners from the image_1 ( the object to be "detected" )
-    std::vector<Point2f> obj_corners(4);
-    obj_corners[0] = cvPoint(0,0);
-    obj_corners[1] = cvPoint( img_object.cols, 0 );
-    obj_corners[2] = cvPoint( img_object.cols, img_object.rows );
-    obj_corners[3] = cvPoint( 0, img_object.rows );
-    std::vector<Point2f> scene_corners(4);
+    if( loc.H.empty() )
+        return false;
+
+    loc.inliers = countNonZero( loc.mask );
+    project_corners( needle, loc );
+
+    return true;
+}
+
+/** Scene points followed from frame to frame, and their needle points */
+struct tracker_t
+{
+    Mat prev;
+    std::vector<Point2f> obj_points;
+    std::vector<Point2f> scene_points;
+    unsigned baseline;          // inliers of the last detection
+};
+
+/**
+ * @function start_tracking
+ *
+ * The RANSAC inliers of a detection in img become the tracked points.
+ */
+static void start_tracking( const Mat& img, const needle_t& needle, const location_t& loc,
+                            tracker_t& tracker )
+{
+    tracker.prev = img;
+    tracker.obj_points.clear();
+    tracker.scene_points.clear();
+
+    for( unsigned i = 0; i < loc.good_matches.size(); i++ )
+    {
+        if( !loc.mask[i] )
+            continue;
+        tracker.obj_points.push_back( needle.features.keypoints[ loc.good_matches[i].queryIdx ].pt );
+        tracker.scene_points.push_back( loc.scene.keypoints[ loc.good_matches[i].trainIdx ].pt );
+    }
+
+    tracker.baseline = tracker.obj_points.size();
+}
+
+/**
+ * @function track
+ *
+ * Follow the tracked points from the previous frame into img with
+ * pyramidal Lucas-Kanade and fit the homography to them again.  Only the
+ * inliers are kept for the next frame.  Returns false when the fit has
+ * drifted: too few points left, fewer than MIN_INLIER_RATIO of the inliers
+ * of the last detection, or a mean reprojection error over
+ * MAX_REPROJECTION_ERROR.  The error is taken over every point the flow
+ * followed, not just the inliers, which RANSAC already fit to within its
+ * own threshold.
+ */
+static bool track( const Mat& img, const needle_t& needle, tracker_t& tracker, location_t& loc )
+{
+    std::vector<Point2f> next;
+    std::vector<uchar> status;
+    std::vector<float> err;
+    int64 t = getTickCount();
+
+    loc.scene.keypoints.clear();
+    loc.good_matches.clear();
+    loc.points = 0;
+    loc.H = Mat();
+    loc.inliers = 0;
+    loc.scene_corners.clear();
+    loc.times = stage_times_t();
+
+    calcOpticalFlowPyrLK( tracker.prev, img, tracker.scene_points, next, status, err,
+                          LK_WINDOW, LK_LEVELS );
+    tracker.prev = img;
+
+    std::vector<Point2f> obj;
+    std::vector<Point2f> scene;
+
+    for( unsigned i = 0; i < next.size(); i++ )
+    {
+        if( status[i] )
+        {
+            obj.push_back( tracker.obj_points[i] );
+            scene.push_back( next[i] );
+        }
+    }
+
+    loc.times.track = lap_ms( t );
+    loc.points = obj.size();
+
+    if( obj.size() < MIN_TRACKED_POINTS )
+        return false;
+
+    loc.H = findHomography( obj, scene, CV_RANSAC, 3, loc.mask );
+
+    if( loc.H.empty() )
+    {
+        loc.times.ransac = lap_ms( t );
+        return false;
+    }
+
+    //-- Mean reprojection error of all followed points; the inliers are tracked further
+    std::vector<Point2f> projected;
+    double error = 0;
+
+    perspectiveTransform( obj, projected, loc.H );
+
+    tracker.obj_points.clear();
+    tracker.scene_points.clear();
+
+    for( unsigned i = 0; i < obj.size(); i++ )
+    {
+        Point2f d = projected[i] - scene[i];
+        error += hypot( d.x, d.y );
+
+        if( loc.mask[i] )
+        {
+            tracker.obj_points.push_back( obj[i] );
+            tracker.scene_points.push_back( scene[i] );
+        }
+    }
+
+    loc.inliers = tracker.obj_points.size();
+    loc.times.ransac = lap_ms( t );
+
+    if( tracker.obj_points.size() < MIN_TRACKED_POINTS ||
+        loc.inliers < MIN_INLIER_RATIO * tracker.baseline ||
+        error / obj.size() > MAX_REPROJECTION_ERROR )
+        return false;
+
+    project_corners( needle, loc );
+
+    return true;
+}
+
+/** @function add_stage_times */
+static void add_stage_times( stage_times_t& sum, const stage_times_t& t )
+{
+    sum.detect += t.detect;
+    sum.describe += t.describe;
+    sum.match += t.match;
+    sum.ransac += t.ransac;
+    sum.track += t.track;
+}
+
+/** @function print_stage_times */
+static void print_stage_times( FILE* f, const stage_times_t& t, unsigned n )
+{
+    fprintf( f, "-- Stages (ms): detect %.2f, describe %.2f, match %.2f, ransac %.2f",
+             t.detect / n, t.describe / n, t.match / n, t.ransac / n );
+    if( t.track > 0 )
+        fprintf( f, ", track %.2f", t.track / n );
+    fprintf( f, "\n" );
+}
+
+/** One image of a batch */
+struct haystack_t
+{
+    std::string name;   // path, or frame number in a video
+    Mat image;          // video frames only; paths are read by the worker
+    bool readable;
+    bool found;
+    bool tracked;       // located by optical flow rather than matching
+    location_t loc;
+};
+
+/** @function haystack_image: the haystack in grayscale */
+static Mat haystack_image( const haystack_t& h )
+{
+    Mat img = h.image;
+
+    if( img.empty() )
+        img = imread( h.name, CV_LOAD_IMAGE_GRAYSCALE );
+    else if( img.channels() != 1 )
+        cvtColor( h.image, img, CV_BGR2GRAY );
 
-    perspectiveTransform( obj_corners, scene_corners, H);
+    return img;
+}
+
+/**
+ * The haystacks of a batch: the images of a directory in name order, the
+ * paths listed one per line in a .txt or .lst file, or the frames of a
+ * video.
+ */
+class haystack_source_t
+{
+public:
+    bool open( const std::string& source )
+    {
+        struct stat st;
+        std::string ext = source.substr( std::min( source.size(), source.rfind( '.' ) ) );
+
+        if( stat( source.c_str(), &st ) == 0 && S_ISDIR( st.st_mode ) )
+            return list_dir( source );
+
+        if( ext == ".txt" || ext == ".lst" )
+            return list_file( source );
+
+        return video.open( source );
+    }
+
+    bool next( haystack_t& h )
+    {
+        if( video.isOpened() )
+        {
+            if( !video.read( h.image ) )
+                return false;
+            h.name = std::to_string( frame++ );
+            return true;
+        }
+
+        if( frame >= paths.size() )
+            return false;
+
+        h.name = paths[frame++];
+        h.image = Mat();
+        return true;
+    }
+
+    haystack_source_t() : frame(0) {}
+
+private:
+    static bool is_image( const std::string& name )
+    {
+        static const char* exts[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff",
+                                      ".pgm", ".ppm", ".pbm" };
+        size_t dot = name.rfind( '.' );
+
+        if( dot == std::string::npos )
+            return false;
+
+        for( unsigned i = 0; i < sizeof(exts) / sizeof(exts[0]); i++ )
+            if( !strcasecmp( name.c_str() + dot, exts[i] ) )
+                return true;
+
+        return false;
+    }
+
+    bool list_dir( const std::string& dir )
+    {
+        DIR* d = opendir( dir.c_str() );
+        struct dirent* e;
+
+        if( d == NULL )
+            return false;
+
+        while( (e = readdir( d )) != NULL )
+            if( is_image( e->d_name ) )
+                paths.push_back( dir + "/" + e->d_name );
+
+        closedir( d );
+        std::sort( paths.begin(), paths.end() );
+
+        return true;
+    }
+
+    bool list_file( const std::string& list )
+    {
+        std::ifstream in( list.c_str() );
+        std::string line;
+
+        if( !in )
+            return false;
+
+        while( std::getline( in, line ) )
+            if( !line.empty() && line[0] != '#' )
+                paths.push_back( line );
+
+        return true;
+    }
+
+    VideoCapture video;
+    std::vector<std::string> paths;
+    size_t frame;
+};
+
+/** @function print_csv_header */
+static void print_csv_header()
+{
+    printf( "haystack,tracked,keypoints,points,inliers" );
+    for( int i = 0; i < 9; i++ )
+        printf( ",h%d%d", i / 3, i % 3 );
+    for( int i = 0; i < 4; i++ )
+        printf( ",x%d,y%d", i, i );
+    printf( ",detect_ms,describe_ms,match_ms,ransac_ms,track_ms\n" );
+}
+
+/**
+ * @function print_csv_row
+ *
+ * The homography and corners are left empty when the needle was not found;
+ * unreadable haystacks have empty counts and times as well.  points are
+ * the good matches, or the points followed when tracked.
+ */
+static void print_csv_row( const haystack_t& h )
+{
+    printf( "%s,%d", h.name.c_str(), h.tracked );
+
+    if( !h.readable )
+        printf( ",,," );
+    else
+        printf( ",%u,%u,%d", (unsigned) h.loc.scene.keypoints.size(),
+                h.loc.points, h.loc.inliers );
+
+    for( int i = 0; i < 9; i++ )
+        if( h.found )
+            printf( ",%.9g", h.loc.H.at<double>( i / 3, i % 3 ) );
+        else
+            printf( "," );
+
+    for( int i = 0; i < 4; i++ )
+        if( h.found )
+            printf( ",%.3f,%.3f", h.loc.scene_corners[i].x, h.loc.scene_corners[i].y );
+        else
+            printf( ",," );
+
+    if( !h.readable )
+        printf( ",,,,,\n" );
+    else
+        printf( ",%.3f,%.3f,%.3f,%.3f,%.3f\n", h.loc.times.detect, h.loc.times.describe,
+                h.loc.times.match, h.loc.times.ransac, h.loc.times.track );
+}
+
+/**
+ * @function run_batch
+ *
+ * Locate the needle in every haystack of source and print one CSV row per
+ * haystack, in input order.  The needle is trained once; haystacks are
+ * read, detected and matched on the pool.  At most BATCH_DEPTH per thread
+ * are read and not yet printed, so that a long video is not decoded all
+ * at once: each time the oldest one finishes its row is printed, along
+ * with those after it that finished before it, and as many haystacks are
+ * read and submitted in their place.
+ */
+static int run_batch( needle_t& needle, const char* source_name, unsigned threads )
+{
+    haystack_source_t source;
+
+    if( !source.open( source_name ) )
+    {
+        std::cerr << " --(!) Cannot open " << source_name << std::endl;
+        return -1;
+    }
+
+    // One slot per haystack in flight, reused in input order
+    struct slot_t
+    {
+        haystack_t h;
+        task_group_t group;
+    };
+
+    task_pool_t pool( threads - 1 );
+    std::vector<slot_t> window( BATCH_DEPTH * pool.size() );
+    stage_times_t times = stage_times_t();
+    unsigned total = 0, found = 0, readable = 0;
+    unsigned submitted = 0;
+    bool more = true;
+
+    print_csv_header();
+
+    int64 t0 = getTickCount();
+
+    for( ;; )
+    {
+        // Workers start on the first haystacks while the rest are decoded
+        while( more && submitted - total < window.size() &&
+               (more = source.next( window[submitted % window.size()].h )) )
+        {
+            slot_t* slot = &window[submitted++ % window.size()];
+            haystack_t* h = &slot->h;
+
+            pool.submit( slot->group, [h, &needle] {
+                Mat img_scene = haystack_image( *h );
+
+                h->tracked = false;
+                h->readable = !img_scene.empty();
+                h->found = h->readable && locate( img_scene, needle, h->loc );
+                h->image = Mat();
+            } );
+        }
+
+        if( total == submitted )
+            break;
+
+        // Runs queued haystacks, not only this one, until it is done
+        slot_t& oldest = window[total % window.size()];
+        pool.wait( oldest.group );
+
+        do
+        {
+            const haystack_t& h = window[total++ % window.size()].h;
+
+            print_csv_row( h );
+            found += h.found;
+
+            if( h.readable )
+            {
+                readable++;
+                add_stage_times( times, h.loc.times );
+            }
+        }
+        while( total < submitted &&
+               window[total % window.size()].group.pending.load( std::memory_order_acquire ) == 0 );
+    }
+
+    fflush( stdout );
+
+    double ms = (getTickCount() - t0) * 1000. / getTickFrequency();
+    fprintf( stderr, "-- %u haystacks, %u found, %.1f ms (%.2f ms/haystack, %u threads)\n",
+             total, found, ms, total ? ms / total : 0., pool.size() );
+    if( readable )
+        print_stage_times( stderr, times, readable );
+
+    return 0;
+}
+
+/**
+ * @function run_track
+ *
+ * Locate the needle in the frames of source in order, detecting and
+ * matching only on the first frame and whenever tracking has drifted or
+ * lost the needle, and following the inliers with optical flow otherwise.
+ * Same CSV as run_batch().
+ */
+static int run_track( needle_t& needle, const char* source_name )
+{
+    haystack_source_t source;
+
+    if( !source.open( source_name ) )
+    {
+        std::cerr << " --(!) Cannot open " << source_name << std::endl;
+        return -1;
+    }
+
+    tracker_t tracker;
+    haystack_t h;
+    stage_times_t times = stage_times_t();
+    unsigned total = 0, found = 0, readable = 0, detections = 0;
+
+    print_csv_header();
+
+    int64 t0 = getTickCount();
+
+    while( source.next( h ) )
+    {
+        Mat img = haystack_image( h );
+
+        total++;
+        h.readable = !img.empty();
+        h.found = false;
+        h.tracked = false;
+
+        if( !h.readable )
+        {
+            tracker.scene_points.clear();
+            print_csv_row( h );
+            continue;
+        }
+
+        bool tracking = !tracker.scene_points.empty();
+
+        if( tracking && track( img, needle, tracker, h.loc ) )
+            h.found = h.tracked = true;
+        else
+        {
+            // Charge the failed tracking attempt to this frame too
+            double lost_ms = tracking ? h.loc.times.track + h.loc.times.ransac : 0;
+
+            detections++;
+            h.found = locate( img, needle, h.loc );
+            h.loc.times.track = lost_ms;
+
+            if( h.found )
+                start_tracking( img, needle, h.loc, tracker );
+            else
+                tracker.scene_points.clear();
+        }
+
+        readable++;
+        found += h.found;
+        add_stage_times( times, h.loc.times );
+        print_csv_row( h );
+    }
+
+    fflush( stdout );
+
+    double ms = (getTickCount() - t0) * 1000. / getTickFrequency();
+    fprintf( stderr, "-- %u frames, %u found, %u detections (%.1f%%), %.1f ms (%.2f ms/frame)\n",
+             total, found, detections, total ? 100. * detections / total : 0.,
+             ms, total ? ms / total : 0. );
+    if( readable )
+        print_stage_times( stderr, times, readable );
+
+    return 0;
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+    const char* cache_dir = NULL;
+    const char* backend_name = BACKENDS[0].name;
+    bool batch = false;
+    bool tracking = false;
+    unsigned threads = std::max( 1u, std::thread::hardware_concurrency() );
+    int argi = 1;
+
+    for( ; argi < argc && !strncmp( argv[argi], "--", 2 ); argi++ )
+    {
+        if( !strcmp( argv[argi], "--cache" ) && argi + 1 < argc )
+            cache_dir = argv[++argi];
+        else if( !strcmp( argv[argi], "--features" ) && argi + 1 < argc )
+            backend_name = argv[++argi];
+        else if( !strcmp( argv[argi], "--batch" ) )
+            batch = true;
+        else if( !strcmp( argv[argi], "--track" ) )
+            batch = tracking = true;
+        else if( !strcmp( argv[argi], "--threads" ) && argi + 1 < argc )
+            threads = std::max( 1, atoi( argv[++argi] ) );
+        else
+            break;
+    }
+
+    if( argc - argi != 2 )
+    {
+        readme();
+        return -1;
+    }
+
+    needle_t needle;
+    needle.backend = NULL;
+
+    for( unsigned i = 0; i < sizeof(BACKENDS) / sizeof(BACKENDS[0]); i++ )
+        if( !strcmp( backend_name, BACKENDS[i].name ) )
+            needle.backend = &BACKENDS[i];
+
+    if( needle.backend == NULL )
+    {
+        std::cerr << " --(!) Unknown or unavailable feature backend " << backend_name << std::endl;
+        return -1;
+    }
+
+    Mat img_object = imread( argv[argi], CV_LOAD_IMAGE_GRAYSCALE );
+
+    if( !img_object.data )
+    {
+        std::cerr << " --(!) Error reading images " << std::endl;
+        return -1;
+    }
+
+    int64 t0 = getTickCount();
+    bool cached = load_needle( img_object, cache_dir, needle );
+    // stdout is the CSV in batch mode
+    fprintf( batch ? stderr : stdout, "-- Needle: %s, %u keypoints, %s, %.1f ms\n",
+             needle.backend->name, (unsigned) needle.features.keypoints.size(),
+             cached ? "cached" : "detected",
+             (getTickCount() - t0) * 1000. / getTickFrequency() );
+
+    if( tracking )
+        return run_track( needle, argv[argi + 1] );
+    if( batch )
+        return run_batch( needle, argv[argi + 1], threads );
+
+    Mat img_scene = imread( argv[argi + 1], CV_LOAD_IMAGE_GRAYSCALE );
+
+    if( !img_scene.data )
+    {
+        std::cout<< " --(!) Error reading images " << std::endl;
+        return -1;
+    }
+
+    location_t loc;
+    bool found = locate( img_scene, needle, loc );
+
+    printf("-- Max dist : %f \n", loc.max_dist );
+    printf("-- Min dist : %f \n", loc.min_dist );
+    printf("-- Good matches : %u, inliers : %d \n", loc.points, loc.inliers );
+    print_stage_times( stdout, loc.times, 1 );
+
+    //-- Draw only "good" matches
+    Mat img_matches;
+    drawMatches( img_object, needle.features.keypoints, img_scene, loc.scene.keypoints,
+                 loc.good_matches, img_matches, Scalar::all(-1), Scalar::all(-1),
+                 vector<char>(), DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS );
 
     //-- Draw lines between the corners (the mapped object in the scene - image_2 )
-    line( img_matches, scene_corners[0] + Point2f( img_object.cols, 0), scene_corners[1] + Point2f( img_object.cols, 0), Scalar(0, 255, 0), 4 );
-    line( img_matches, scene_corners[1] + Point2f( img_object.cols, 0), scene_corners[2] + Point2f( img_object.cols, 0), Scalar( 0, 255, 0), 4 );
-    line( img_matches, scene_corners[2] + Point2f( img_object.cols, 0), scene_corners[3] + Point2f( img_object.cols, 0), Scalar( 0, 255, 0), 4 );
-    line( img_matches, scene_corners[3] + Point2f( img_object.cols, 0), scene_corners[0] + Point2f( img_object.cols, 0), Scalar( 0, 255, 0), 4 );
+    if( found )
+    {
+        const std::vector<Point2f>& scene_corners = loc.scene_corners;
+
+        line( img_matches, scene_corners[0] + Point2f( img_object.cols, 0), scene_corners[1] + Point2f( img_object.cols, 0), Scalar(0, 255, 0), 4 );
+        line( img_matches, scene_corners[1] + Point2f( img_object.cols, 0), scene_corners[2] + Point2f( img_object.cols, 0), Scalar( 0, 255, 0), 4 );
+        line( img_matches, scene_corners[2] + Point2f( img_object.cols, 0), scene_corners[3] + Point2f( img_object.cols, 0), Scalar( 0, 255, 0), 4 );
+        line( img_matches, scene_corners[3] + Point2f( img_object.cols, 0), scene_corners[0] + Point2f( img_object.cols, 0), Scalar( 0, 255, 0), 4 );
+    }
+    else
+        std::cout << " --(!) Needle not found " << std::endl;
 
     //-- Show detected matches
     
@@ -120,5 +970,9 @@ int main( int argc, char** argv )
 
 /** @function readme */
 void readme() {
-    std::cout << " Usage: ./SURF_descriptor <needle> <haystack>" << std::endl;
+    std::cout << " Usage: ./SURF_descriptor [--features surf|orb|brisk] [--cache dir] <needle> <haystack>" << std::endl;
+    std::cout << "        ./SURF_descriptor [--features surf|orb|brisk] [--cache dir] [--threads n]" << std::endl;
+    std::cout << "                          --batch <needle> <dir|list|video>" << std::endl;
+    std::cout << "        ./SURF_descriptor [--features surf|orb|brisk] [--cache dir]" << std::endl;
+    std::cout << "                          --track <needle> <dir|list|video>" << std::endl;
 }
@@ -0,0 +1,239 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef INCREMENTAL_CANNY_HPP
+#define INCREMENTAL_CANNY_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+/*
+ * cv::Canny() with a 3x3 aperture and the L1 gradient, split into the part
+ * that depends on the image and the part that depends on the thresholds.
+ *
+ * set_image() runs the Sobel filters, the magnitude and the non-maximum
+ * suppression once and keeps every local maximum along its gradient,
+ * sorted by decreasing magnitude.  For a pair of thresholds the edge
+ * candidates (magnitude > low) are then a prefix of that list, the seeds
+ * (magnitude > high) a shorter prefix, and hysteresis is a flood fill from
+ * the seeds through the candidates, touching nothing else.
+ *
+ * The local maximum test is the one of OpenCV 2.4, asymmetric comparisons
+ * included, so the edges are exactly those of cv::Canny():
+ *
+ *      horizontal gradient     m >  left   && m >= right
+ *      vertical gradient       m >  above  && m >= below
+ *      diagonal gradient       m >  both neighbours along the diagonal
+ *
+ * with magnitudes outside the image counted as 0, and the thresholds
+ * swapped if need be and floored to integers.
+ */
+
+/**
+ * Working memory of one hysteresis run; one per thread.
+ */
+struct canny_scratch_t {
+        std::vector<uchar> map;         // padded image, 0 between runs
+        std::vector<int>   stack;
+};
+
+class incremental_canny_t {
+public:
+        incremental_canny_t() : rows(0), cols(0), stride(0) {}
+
+        /**
+         * Gradients and local maxima of gray, a CV_8UC1 image.
+         */
+        void set_image(const cv::Mat& gray)
+        {
+                CV_Assert(gray.type() == CV_8UC1);
+
+                cv::Mat dx, dy;
+                cv::Sobel(gray, dx, CV_16S, 1, 0, 3, 1, 0, cv::BORDER_REPLICATE);
+                cv::Sobel(gray, dy, CV_16S, 0, 1, 3, 1, 0, cv::BORDER_REPLICATE);
+
+                rows = gray.rows;
+                cols = gray.cols;
+                stride = cols + 2;
+
+                // One pixel of zero magnitude all around
+                std::vector<int> mag((rows + 2) * stride, 0);
+
+                for (int y = 0; y < rows; y++) {
+                        const short* gx = dx.ptr<short>(y);
+                        const short* gy = dy.ptr<short>(y);
+                        int* m = &mag[(y + 1) * stride + 1];
+
+                        for (int x = 0; x < cols; x++)
+                                m[x] = std::abs(gx[x]) + std::abs(gy[x]);
+                }
+
+                // tan(22.5 degrees) in fixed point, as in cv::Canny()
+                const int SHIFT = 15;
+                const int TG22 = (int) (0.4142135623730950488 * (1 << SHIFT) + 0.5);
+
+                std::vector<int> index, count(MAX_MAGNITUDE + 1, 0);
+
+                for (int y = 0; y < rows; y++) {
+                        const short* gx = dx.ptr<short>(y);
+                        const short* gy = dy.ptr<short>(y);
+
+                        for (int x = 0; x < cols; x++) {
+                                const int p = (y + 1) * stride + x + 1;
+                                const int m = mag[p];
+
+                                // Never above a threshold, and never a maximum
+                                if (m == 0)
+                                        continue;
+
+                                const int xs = gx[x], ys = gy[x];
+                                const int ax = std::abs(xs), ay = std::abs(ys) << SHIFT;
+                                const int tg22x = ax * TG22;
+                                const int tg67x = tg22x + (ax << (SHIFT + 1));
+                                bool keep;
+
+                                if (ay < tg22x) {
+                                        keep = m > mag[p - 1] && m >= mag[p + 1];
+                                }
+                                else if (ay > tg67x) {
+                                        keep = m > mag[p - stride] && m >= mag[p + stride];
+                                }
+                                else {
+                                        const int s = (xs ^ ys) < 0 ? -1 : 1;
+                                        keep = m > mag[p - stride - s] && m > mag[p + stride + s];
+                                }
+
+                                if (keep) {
+                                        index.push_back(p);
+                                        count[m]++;
+                                }
+                        }
+                }
+
+                // Counting sort by decreasing magnitude; above[t] is the
+                // number of maxima with magnitude > t
+                above.assign(MAX_MAGNITUDE + 2, 0);
+                for (int t = MAX_MAGNITUDE - 1; t >= 0; t--)
+                        above[t] = above[t + 1] + count[t + 1];
+                above[MAX_MAGNITUDE + 1] = above[0] + count[0];
+
+                std::vector<int> next(above.begin(), above.end() - 1);
+                maxima.resize(index.size());
+
+                for (size_t i = 0; i < index.size(); i++) {
+                        const int m = mag[index[i]];
+                        maxima[next[m]++] = index[i];
+                }
+        }
+
+        cv::Size size() const { return cv::Size(cols, rows); }
+
+        /**
+         * Local maxima with magnitude > low, i.e. the edge candidates.
+         */
+        size_t candidates(double low) const
+        {
+                return count_above(cvFloor(low));
+        }
+
+        /**
+         * Edge pixels for the thresholds, as indices y * cols + x in no
+         * particular order.  Safe to call from several threads at once,
+         * each with its own scratch.
+         */
+        void hysteresis(double low, double high, std::vector<int>& edges,
+                        canny_scratch_t& scratch) const
+        {
+                if (low > high)
+                        std::swap(low, high);
+
+                const size_t ncandidates = count_above(cvFloor(low));
+                const size_t nseeds = count_above(cvFloor(high));
+                const int offsets[8] = {
+                        -stride - 1, -stride, -stride + 1, -1, 1, stride - 1, stride, stride + 1
+                };
+                std::vector<uchar>& map = scratch.map;
+                std::vector<int>& stack = scratch.stack;
+
+                if (map.size() != (size_t) (rows + 2) * stride)
+                        map.assign((rows + 2) * stride, 0);
+
+                edges.clear();
+
+                for (size_t i = 0; i < ncandidates; i++)
+                        map[maxima[i]] = 1;
+
+                for (size_t i = 0; i < nseeds; i++) {
+                        if (map[maxima[i]] != 1)
+                                continue;
+
+                        map[maxima[i]] = 2;
+                        stack.push_back(maxima[i]);
+
+                        while (!stack.empty()) {
+                                const int p = stack.back();
+                                stack.pop_back();
+                                edges.push_back(p);
+
+                                for (int k = 0; k < 8; k++) {
+                                        if (map[p + offsets[k]] == 1) {
+                                                map[p + offsets[k]] = 2;
+                                                stack.push_back(p + offsets[k]);
+                                        }
+                                }
+                        }
+                }
+
+                // Leave the map clear for the next run
+                for (size_t i = 0; i < ncandidates; i++)
+                        map[maxima[i]] = 0;
+
+                for (size_t i = 0; i < edges.size(); i++)
+                        edges[i] = (edges[i] / stride - 1) * cols + edges[i] % stride - 1;
+        }
+
+        const std::vector<int>& hysteresis(double low, double high)
+        {
+                hysteresis(low, high, edges, scratch);
+                return edges;
+        }
+
+        /**
+         * Same as cv::Canny(image, dst, low, high, 3).
+         */
+        void canny(double low, double high, cv::Mat& dst)
+        {
+                hysteresis(low, high);
+
+                dst.create(rows, cols, CV_8UC1);
+                dst = cv::Scalar::all(0);
+
+                for (size_t i = 0; i < edges.size(); i++)
+                        dst.ptr<uchar>(edges[i] / cols)[edges[i] % cols] = 255;
+        }
+
+private:
+        // |dx| + |dy| of the 3x3 Sobel filters on 8 bit pixels
+        static const int MAX_MAGNITUDE = 2 * 4 * 255;
+
+        size_t count_above(int t) const
+        {
+                if (above.empty())
+                        return 0;
+                if (t < 0)
+                        return above[MAX_MAGNITUDE + 1];
+                return t >= MAX_MAGNITUDE ? 0 : above[t];
+        }
+
+        int rows, cols, stride;
+        std::vector<int> maxima;        // padded indices, by decreasing magnitude
+        std::vector<int> above;         // maxima with magnitude > t, then all of them
+
+        std::vector<int> edges;
+        canny_scratch_t scratch;
+};
+
+#endif
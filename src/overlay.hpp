@@ -0,0 +1,272 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef OVERLAY_HPP
+#define OVERLAY_HPP
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+/**
+ * Display list of what to draw over a frame.
+ *
+ * Drawing code records primitives instead of writing into the frame, so
+ * the frame stays untouched for whoever else reads it, and nothing is
+ * drawn at all unless the frame is shown.  composite() draws the list onto
+ * a frame in recording order, saving the pixels under each primitive
+ * first; restore() puts them back in reverse order, leaving the frame
+ * exactly as it was.  Only the bounding boxes of the primitives are
+ * copied, four thin strips for a rectangle outline, never the frame.
+ *
+ * Images recorded with image() are referenced, not copied, and must stay
+ * valid until composite().
+ */
+class overlay_t {
+public:
+        void clear()
+        {
+                items.clear();
+        }
+
+        bool empty() const { return items.empty(); }
+
+        void rectangle(const cv::Rect& r, const cv::Scalar& color, int thickness = 1,
+                        int line_type = 8)
+        {
+                item_t& i = add(RECTANGLE, color, thickness, line_type);
+                i.rect = r;
+        }
+
+        /**
+         * A line; with a non-empty clip it is clipped to that part of the
+         * frame, as if drawn into frame(clip).
+         */
+        void line(cv::Point p1, cv::Point p2, const cv::Scalar& color, int thickness = 1,
+                        int line_type = 8, const cv::Rect& clip = cv::Rect())
+        {
+                item_t& i = add(LINE, color, thickness, line_type);
+                i.p1 = p1;
+                i.p2 = p2;
+                i.clip = clip;
+        }
+
+        void contours(const std::vector<std::vector<cv::Point> >& c, const cv::Scalar& color,
+                        int thickness = 1, int line_type = 8)
+        {
+                item_t& i = add(CONTOURS, color, thickness, line_type);
+                i.contours = c;
+        }
+
+        void text(const std::string& s, cv::Point org, int font, double scale,
+                        const cv::Scalar& color, int thickness = 1)
+        {
+                item_t& i = add(TEXT, color, thickness, 8);
+                i.text = s;
+                i.p1 = org;
+                i.font = font;
+                i.scale = scale;
+        }
+
+        /**
+         * Copy src over the dst rectangle of the frame.
+         */
+        void image(const cv::Mat& src, const cv::Rect& dst)
+        {
+                item_t& i = add(IMAGE, cv::Scalar(), 0, 8);
+                i.image = src;
+                i.rect = dst;
+        }
+
+        /**
+         * Draw the list onto frame, keeping what it covers for restore().
+         */
+        void composite(cv::Mat& frame)
+        {
+                const cv::Rect bounds(cv::Point(), frame.size());
+
+                nsaved = 0;
+
+                for (size_t n = 0; n < items.size(); n++) {
+                        const item_t& i = items[n];
+                        cv::Rect boxes[4];
+                        int nboxes = damage(i, boxes);
+
+                        for (int b = 0; b < nboxes; b++)
+                                save(frame, boxes[b] & bounds);
+
+                        draw(i, frame, bounds);
+                }
+        }
+
+        /**
+         * Undo the last composite() on frame.
+         */
+        void restore(cv::Mat& frame)
+        {
+                for (size_t n = nsaved; n-- > 0; )
+                        saved[n].pixels.copyTo(frame(saved[n].rect));
+
+                nsaved = 0;
+        }
+
+private:
+        enum kind_t { RECTANGLE, LINE, CONTOURS, TEXT, IMAGE };
+
+        struct item_t {
+                kind_t          kind;
+                cv::Scalar      color;
+                int             thickness;
+                int             line_type;
+                cv::Rect        rect;
+                cv::Rect        clip;
+                cv::Point       p1, p2;
+                std::vector<std::vector<cv::Point> > contours;
+                std::string     text;
+                int             font;
+                double          scale;
+                cv::Mat         image;
+        };
+
+        struct saved_t {
+                cv::Rect        rect;
+                cv::Mat         pixels;
+        };
+
+        item_t& add(kind_t kind, const cv::Scalar& color, int thickness, int line_type)
+        {
+                items.push_back(item_t());
+                item_t& i = items.back();
+                i.kind = kind;
+                i.color = color;
+                i.thickness = thickness;
+                i.line_type = line_type;
+                return i;
+        }
+
+        static cv::Rect grow(const cv::Rect& r, int d)
+        {
+                return cv::Rect(r.x - d, r.y - d, r.width + 2 * d, r.height + 2 * d);
+        }
+
+        /**
+         * Up to four rectangles covering every pixel i can touch, with a
+         * margin for thick and antialiased strokes.
+         */
+        static int damage(const item_t& i, cv::Rect* boxes)
+        {
+                const int d = std::max(i.thickness, 1) / 2 + 2;
+
+                switch (i.kind) {
+                case RECTANGLE: {
+                        const cv::Rect& r = i.rect;
+
+                        if (i.thickness < 0 || r.width <= 4 * d || r.height <= 4 * d) {
+                                boxes[0] = grow(r, d);
+                                return 1;
+                        }
+
+                        // rectangle() strokes from tl() to br() - (1, 1)
+                        boxes[0] = grow(cv::Rect(r.x, r.y, r.width, 1), d);
+                        boxes[1] = grow(cv::Rect(r.x, r.y + r.height - 1, r.width, 1), d);
+                        boxes[2] = grow(cv::Rect(r.x, r.y + 1, 1, r.height - 2), d);
+                        boxes[3] = grow(cv::Rect(r.x + r.width - 1, r.y + 1, 1, r.height - 2), d);
+                        return 4;
+                }
+                case LINE: {
+                        cv::Rect r(std::min(i.p1.x, i.p2.x), std::min(i.p1.y, i.p2.y),
+                                   std::abs(i.p1.x - i.p2.x) + 1, std::abs(i.p1.y - i.p2.y) + 1);
+
+                        boxes[0] = grow(r, d);
+                        if (i.clip.area() > 0)
+                                boxes[0] &= i.clip;
+                        return 1;
+                }
+                case CONTOURS: {
+                        std::vector<cv::Point> all;
+
+                        for (size_t c = 0; c < i.contours.size(); c++)
+                                all.insert(all.end(), i.contours[c].begin(), i.contours[c].end());
+
+                        if (all.empty())
+                                return 0;
+
+                        boxes[0] = grow(cv::boundingRect(all), d);
+                        return 1;
+                }
+                case TEXT: {
+                        int baseline = 0;
+                        cv::Size size = cv::getTextSize(i.text, i.font, i.scale, i.thickness, &baseline);
+
+                        boxes[0] = grow(cv::Rect(i.p1.x, i.p1.y - size.height, size.width,
+                                                 size.height + baseline), d);
+                        return 1;
+                }
+                case IMAGE:
+                        boxes[0] = i.rect;
+                        return 1;
+                }
+
+                return 0;
+        }
+
+        void save(const cv::Mat& frame, const cv::Rect& r)
+        {
+                if (r.area() <= 0)
+                        return;
+
+                // The buffers are kept from frame to frame
+                if (nsaved == saved.size())
+                        saved.push_back(saved_t());
+
+                saved_t& s = saved[nsaved++];
+                s.rect = r;
+                frame(r).copyTo(s.pixels);
+        }
+
+        static void draw(const item_t& i, cv::Mat& frame, const cv::Rect& bounds)
+        {
+                switch (i.kind) {
+                case RECTANGLE:
+                        cv::rectangle(frame, i.rect, i.color, i.thickness, i.line_type);
+                        break;
+
+                case LINE:
+                        if (i.clip.area() > 0) {
+                                cv::Rect c = i.clip & bounds;
+                                cv::Mat target = frame(c);
+                                cv::line(target, i.p1 - c.tl(), i.p2 - c.tl(), i.color,
+                                         i.thickness, i.line_type);
+                        }
+                        else {
+                                cv::line(frame, i.p1, i.p2, i.color, i.thickness, i.line_type);
+                        }
+                        break;
+
+                case CONTOURS:
+                        cv::drawContours(frame, i.contours, -1, i.color, i.thickness, i.line_type);
+                        break;
+
+                case TEXT:
+                        cv::putText(frame, i.text, i.p1, i.font, i.scale, i.color, i.thickness);
+                        break;
+
+                case IMAGE: {
+                        cv::Rect r = i.rect & bounds;
+
+                        if (r.area() > 0)
+                                i.image(cv::Rect(r.tl() - i.rect.tl(), r.size()))
+                                        .copyTo(frame(r));
+                        break;
+                }
+                }
+        }
+
+        std::vector<item_t>  items;
+        std::vector<saved_t> saved;
+        size_t               nsaved = 0;
+};
+
+#endif
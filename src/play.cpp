@@ -7,6 +7,9 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
+#include "capture.hpp"
+#include "overlay.hpp"
+
 using namespace cv;
 
 const char* VIDEO_FILE = "../data/balance.m4v";
@@ -19,23 +22,26 @@ static void onMouse(int, int, int, int, void*);
 
 int main(int argc, const char** argv)
 {
-    VideoCapture vc;
+    const char* input = argc > 1 ? argv[1] : VIDEO_FILE;
+    capture_t capture;
+    frame_t frame;
     std::vector<char> s(4096);
 
-    if (!vc.open(VIDEO_FILE)) {
-        CV_Error_(-1, ("failed to open video: \"%s\"", VIDEO_FILE));
+    if (!capture.open(input, true)) {
+        CV_Error_(-1, ("failed to open input: \"%s\"", input));
         std::exit(1);
     }
 
     int key = 0;
     bool pause = false;
     Point selection(-1000, -1000);
-    Mat pristine, a, b;
+    Mat& pristine = frame.image;
+    overlay_t overlay;
 
     namedWindow(WINDOW_NAME, CV_WINDOW_NORMAL);
     resizeWindow(WINDOW_NAME,
-                 (int)vc.get(CV_CAP_PROP_FRAME_WIDTH),
-                 (int)vc.get(CV_CAP_PROP_FRAME_HEIGHT));
+                 capture.frame_size().width,
+                 capture.frame_size().height);
     setMouseCallback(WINDOW_NAME, onMouse, &selection);
 
     while (true)
@@ -45,38 +51,36 @@ int main(int argc, const char** argv)
         }
 
         if (!pause) {
-            if (! vc.read(pristine)) {
-                vc.set(CV_CAP_PROP_POS_FRAMES, 0U);
-                vc.read(pristine);
-            };
+            if (!capture.read(frame)) {
+                break;
+            }
         }
 
-        pristine.copyTo(a);
-
-        Mat& post = a;
+        overlay.clear();
 
-        rectangle(post,
-                  selection - SELECT_HALF_SIZE,
-                  selection + SELECT_HALF_SIZE,
-                  Scalar(0,255,0), SELECT_LINE_WIDTH);
+        overlay.rectangle(Rect(selection - SELECT_HALF_SIZE,
+                               selection + SELECT_HALF_SIZE),
+                          Scalar(0,255,0), SELECT_LINE_WIDTH);
 
-        std::sprintf(&s[0], "CNT: %5u", (unsigned) vc.get(CV_CAP_PROP_FRAME_COUNT));
-        putText(post,
-                &s[0],
-                Point(vc.get(CV_CAP_PROP_FRAME_WIDTH)-200,TEXT_LINE_PITCH * 1),
-                FONT_HERSHEY_PLAIN,
-                1,
-                Scalar(255,255,255));
+        std::sprintf(&s[0], "CNT: %5u", frame.count);
+        overlay.text(&s[0],
+                     Point(pristine.cols-200,TEXT_LINE_PITCH * 1),
+                     FONT_HERSHEY_PLAIN,
+                     1,
+                     Scalar(255,255,255));
 
-        std::sprintf(&s[0], "F#:  %5u", (unsigned) vc.get(CV_CAP_PROP_POS_FRAMES));
-        putText(post,
-                &s[0],
-                Point(vc.get(CV_CAP_PROP_FRAME_WIDTH)-200,TEXT_LINE_PITCH * 2),
-                FONT_HERSHEY_PLAIN,
-                1,
-                Scalar(255,255,255));
+        std::sprintf(&s[0], "F#:  %5u", frame.num + 1);
+        overlay.text(&s[0],
+                     Point(pristine.cols-200,TEXT_LINE_PITCH * 2),
+                     FONT_HERSHEY_PLAIN,
+                     1,
+                     Scalar(255,255,255));
 
-        imshow(WINDOW_NAME, post);
+        // Draw over the decoded frame only while showing it; it is still
+        // pristine afterwards, for the next pass when paused
+        overlay.composite(pristine);
+        imshow(WINDOW_NAME, pristine);
+        overlay.restore(pristine);
 
         key = waitKey(1);
 
@@ -92,7 +96,7 @@ int main(int argc, const char** argv)
         }
     }
 
-    vc.release();
+    capture.close();
 
     return 0;
 }
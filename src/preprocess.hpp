@@ -0,0 +1,444 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef PREPROCESS_HPP
+#define PREPROCESS_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+/**
+ * How a BGR region is turned into the binary mask the contour detectors
+ * work on.
+ *
+ * EXACT runs the original chain (medianBlur 3, bilateralFilter 5/75/75,
+ * BGR2GRAY, inverted threshold at 100) and matches it bit for bit.
+ *
+ * FAST does the same four steps fused into one pass over the region: the
+ * 3x3 median is vectorized over the interleaved channels, the bilateral
+ * filter runs on the gray image (intensity instead of per-channel L1
+ * colour distance) with integer weights, and the threshold is folded into
+ * the filter so no division is needed.  The mask is not the same as
+ * EXACT's: besides rounding right at the threshold, neighbours of equal
+ * gray but different colour are smoothed together, so pixels along
+ * strongly coloured edges can flip well away from the threshold.  Use
+ * EXACT where the mask must match the reference chain.
+ */
+enum binarize_mode { BINARIZE_EXACT = 0, BINARIZE_FAST = 1 };
+
+class binarizer_t {
+public:
+        static const int    MEDIAN_SIZE     = 3;
+        static const int    BILATERAL_D     = 5;
+        static const int    THRESHOLD       = 100;
+        static constexpr double SIGMA_COLOR = 75;
+        static constexpr double SIGMA_SPACE = 75;
+
+        binarizer_t()
+        {
+                // Weights for the 13 taps of the radius 2 disk used by
+                // bilateralFilter(d = 5), split into a space and a range
+                // term.  Q12 fixed point keeps the products in 32 bits.
+                for (int i = 0; i < 256; i++)
+                        color_weight[i] = (int) lround(4096 *
+                                exp(-0.5 * i * i / (SIGMA_COLOR * SIGMA_COLOR)));
+
+                ntaps = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                        for (int dx = -2; dx <= 2; dx++) {
+                                if (dx * dx + dy * dy > 4)
+                                        continue;
+                                tap_dx[ntaps] = dx;
+                                tap_dy[ntaps] = dy;
+                                space_weight[ntaps] = (int) lround(4096 *
+                                        exp(-0.5 * (dx * dx + dy * dy) /
+                                                (SIGMA_SPACE * SIGMA_SPACE)));
+                                ntaps++;
+                        }
+                }
+        }
+
+        /**
+         * Binarize the 8UC3 region src into the 8UC1 mask dst: 255 where the
+         * filtered intensity is at or below the threshold, 0 elsewhere.
+         */
+        void operator()(const cv::Mat& src, cv::Mat& dst, binarize_mode mode)
+        {
+                CV_Assert(src.type() == CV_8UC3);
+
+                if (mode == BINARIZE_EXACT || src.rows < 3 || src.cols < 3) {
+                        cv::medianBlur(src, blur1, MEDIAN_SIZE);
+                        cv::bilateralFilter(blur1, blur2, BILATERAL_D, SIGMA_COLOR, SIGMA_SPACE);
+                        cv::cvtColor(blur2, gray, CV_BGR2GRAY);
+                        cv::threshold(gray, dst, THRESHOLD, 255, cv::THRESH_BINARY_INV);
+                        return;
+                }
+
+                fused(src, dst);
+        }
+
+private:
+        /**
+         * One pass, top to bottom.  Each source row is median filtered and
+         * converted to gray exactly once into a rolling window of five
+         * padded gray rows, and each output row is produced as soon as the
+         * two rows below it are available, so the working set is a handful
+         * of rows regardless of the region size.
+         */
+        void fused(const cv::Mat& src, cv::Mat& dst)
+        {
+                const int w = src.cols, h = src.rows;
+                const int stride = w + 4;
+
+                dst.create(h, w, CV_8UC1);
+                median_row.resize(w * 3);
+                window.resize(stride * 5);
+
+                // Rows -2 and -1 reflect rows 2 and 1 (BORDER_REFLECT_101);
+                // they are filled when those rows come through.
+                for (int y = 0; y < h + 2; y++) {
+                        if (y < h) {
+                                gray_row(src, y, &window[slot(y) * stride + 2]);
+                                pad_row(&window[slot(y) * stride + 2], w);
+
+                                if (y == 1 || y == 2) {
+                                        std::copy(&window[slot(y) * stride],
+                                                  &window[slot(y) * stride] + stride,
+                                                  &window[slot(-y) * stride]);
+                                }
+                        }
+                        else {
+                                int r = 2 * (h - 1) - y;
+                                std::copy(&window[slot(r) * stride],
+                                          &window[slot(r) * stride] + stride,
+                                          &window[slot(y) * stride]);
+                        }
+
+                        if (y >= 2)
+                                bilateral_threshold_row(y - 2, w, stride,
+                                                dst.ptr<uchar>(y - 2));
+                }
+        }
+
+        static int slot(int y) { return (y + 5) % 5; }
+
+        /**
+         * Median filter source row y (replicated borders) and convert the
+         * result to gray with the same fixed point weights as cvtColor.
+         */
+        void gray_row(const cv::Mat& src, int y, uchar* out)
+        {
+                const int w = src.cols, n = w * 3;
+                const uchar* r0 = src.ptr<uchar>(y > 0 ? y - 1 : 0);
+                const uchar* r1 = src.ptr<uchar>(y);
+                const uchar* r2 = src.ptr<uchar>(y < src.rows - 1 ? y + 1 : y);
+                uchar* m = &median_row[0];
+
+                // First and last pixels replicate their own column.
+                for (int c = 0; c < 3; c++) {
+                        m[c] = median9_edge(r0, r1, r2, c, c, c + 3);
+                        m[n - 3 + c] = median9_edge(r0, r1, r2, n - 6 + c, n - 3 + c, n - 3 + c);
+                }
+
+                int i = 3;
+#if defined(__AVX2__)
+                for (; i + 32 <= n - 3; i += 32) {
+                        __m256i v[9];
+                        load3(v + 0, r0 + i);
+                        load3(v + 3, r1 + i);
+                        load3(v + 6, r2 + i);
+                        _mm256_storeu_si256((__m256i*) (m + i), median9(v));
+                }
+#endif
+#if defined(__SSE2__)
+                for (; i + 16 <= n - 3; i += 16) {
+                        __m128i v[9];
+                        load3(v + 0, r0 + i);
+                        load3(v + 3, r1 + i);
+                        load3(v + 6, r2 + i);
+                        _mm_storeu_si128((__m128i*) (m + i), median9(v));
+                }
+#endif
+                for (; i < n - 3; i++) {
+                        uchar v[9] = {
+                                r0[i - 3], r0[i], r0[i + 3],
+                                r1[i - 3], r1[i], r1[i + 3],
+                                r2[i - 3], r2[i], r2[i + 3]
+                        };
+                        m[i] = median9(v);
+                }
+
+                for (int x = 0; x < w; x++) {
+                        const uchar* p = m + x * 3;
+                        out[x] = (uchar) ((p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + (1 << 13)) >> 14);
+                }
+        }
+
+        static uchar median9_edge(const uchar* r0, const uchar* r1, const uchar* r2,
+                        int l, int c, int r)
+        {
+                uchar v[9] = { r0[l], r0[c], r0[r], r1[l], r1[c], r1[r], r2[l], r2[c], r2[r] };
+                return median9(v);
+        }
+
+        static void pad_row(uchar* row, int w)
+        {
+                row[-1] = row[w > 1 ? 1 : 0];
+                row[-2] = row[w > 2 ? 2 : 0];
+                row[w]     = row[w > 1 ? w - 2 : 0];
+                row[w + 1] = row[w > 2 ? w - 3 : 0];
+        }
+
+        /**
+         * Bilateral filter output row y from the window and threshold it.
+         * out = round(sum(w * v) / sum(w)) > T  <=>  2 * sum(w * v) >= (2T + 1) * sum(w)
+         */
+        void bilateral_threshold_row(int y, int w, int stride, uchar* out)
+        {
+                const uchar* rows[5];
+                for (int k = 0; k < 5; k++)
+                        rows[k] = &window[slot(y - 2 + k) * stride + 2];
+
+                for (int x = 0; x < w; x++) {
+                        const int c = rows[2][x];
+                        int64_t sum = 0, wsum = 0;
+
+                        for (int t = 0; t < ntaps; t++) {
+                                const int v = rows[2 + tap_dy[t]][x + tap_dx[t]];
+                                const int wt = space_weight[t] * color_weight[v > c ? v - c : c - v];
+                                sum += (int64_t) wt * v;
+                                wsum += wt;
+                        }
+
+                        out[x] = 2 * sum >= (2 * THRESHOLD + 1) * wsum ? 0 : 255;
+                }
+        }
+
+        // Median of nine by the 19 compare-exchange network from
+        // Devillard/Paeth, written once for scalars and vectors.
+
+        static inline void sort2(uchar& a, uchar& b)
+        {
+                uchar t = a < b ? a : b;
+                b = a < b ? b : a;
+                a = t;
+        }
+#if defined(__SSE2__)
+        static inline void sort2(__m128i& a, __m128i& b)
+        {
+                __m128i t = _mm_min_epu8(a, b);
+                b = _mm_max_epu8(a, b);
+                a = t;
+        }
+
+        static inline void load3(__m128i* v, const uchar* p)
+        {
+                v[0] = _mm_loadu_si128((const __m128i*) (p - 3));
+                v[1] = _mm_loadu_si128((const __m128i*) p);
+                v[2] = _mm_loadu_si128((const __m128i*) (p + 3));
+        }
+#endif
+#if defined(__AVX2__)
+        static inline void sort2(__m256i& a, __m256i& b)
+        {
+                __m256i t = _mm256_min_epu8(a, b);
+                b = _mm256_max_epu8(a, b);
+                a = t;
+        }
+
+        static inline void load3(__m256i* v, const uchar* p)
+        {
+                v[0] = _mm256_loadu_si256((const __m256i*) (p - 3));
+                v[1] = _mm256_loadu_si256((const __m256i*) p);
+                v[2] = _mm256_loadu_si256((const __m256i*) (p + 3));
+        }
+#endif
+
+        template <typename V>
+        static inline V median9(V* p)
+        {
+                sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+                sort2(p[0], p[1]); sort2(p[3], p[4]); sort2(p[6], p[7]);
+                sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+                sort2(p[0], p[3]); sort2(p[5], p[8]); sort2(p[4], p[7]);
+                sort2(p[3], p[6]); sort2(p[1], p[4]); sort2(p[2], p[5]);
+                sort2(p[4], p[7]); sort2(p[4], p[2]); sort2(p[6], p[4]);
+                sort2(p[4], p[2]);
+                return p[4];
+        }
+
+        cv::Mat blur1, blur2, gray;
+        std::vector<uchar> median_row, window;
+
+        int ntaps;
+        int tap_dx[13], tap_dy[13], space_weight[13];
+        int color_weight[256];
+};
+
+/**
+ * Per channel gain, BGR to gray and binary threshold of an 8UC3 image in
+ * one pass, optionally inverted: the same as
+ *
+ *      split, channel c scaled by gain[c], merge, cvtColor(BGR2GRAY),
+ *      threshold(thresh, 255, THRESH_BINARY), and 255 - that if invert
+ *
+ * bit for bit.  Like convertTo(), each gained channel is rounded from the
+ * single precision product to nearest even and saturated; the gray
+ * conversion uses OpenCV's 14 bit fixed point weights.  A pixel is then
+ * set when the weighted sum reaches (thresh + 1) << 14.
+ *
+ * The scalar path looks each channel's weighted contribution up in a 256
+ * entry table built once per parameter set.  The SSE4.1/AVX2 paths do 4/8
+ * pixels at a time: one pshufb per channel spreads the interleaved bytes
+ * into 32 bit lanes, which are gained in float and weighted with mullo.
+ */
+class gain_binarizer_t {
+public:
+        gain_binarizer_t(float gain_b, float gain_g, float gain_r, int thresh, bool invert)
+                : invert(invert)
+        {
+                const float g[3] = { gain_b, gain_g, gain_r };
+                const int w[3] = { 1868, 9617, 4899 };
+
+                for (int c = 0; c < 3; c++) {
+                        gain[c] = g[c];
+                        weight[c] = w[c];
+
+                        for (int v = 0; v < 256; v++)
+                                lut[c][v] = w[c] * cv::saturate_cast<uchar>(v * g[c]);
+                }
+
+                // Rounding term of the fixed point conversion
+                for (int v = 0; v < 256; v++)
+                        lut[2][v] += 1 << 13;
+
+                // Lowest weighted sum whose gray value is above thresh
+                limit = thresh < 0 ? 0 : thresh >= 255 ? INT32_MAX : (thresh + 1) << 14;
+        }
+
+        /**
+         * Binarize src into dst (8UC1), reusing dst's buffer when it has the
+         * right size already.
+         */
+        void operator()(const cv::Mat& src, cv::Mat& dst) const
+        {
+                CV_Assert(src.type() == CV_8UC3);
+
+                dst.create(src.size(), CV_8UC1);
+
+                for (int y = 0; y < src.rows; y++)
+                        row(src.ptr<uchar>(y), dst.ptr<uchar>(y), src.cols);
+        }
+
+private:
+        void row(const uchar* p, uchar* out, int n) const
+        {
+                const uchar on = invert ? 0 : 255;
+                int i = 0;
+
+#if defined(__SSE4_1__)
+                const __m128i shuf_b = _mm_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+                const __m128i shuf_g = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+                const __m128i shuf_r = _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+
+#if defined(__AVX2__)
+                const __m256i shuf_b2 = _mm256_setr_m128i(shuf_b, shuf_b);
+                const __m256i shuf_g2 = _mm256_setr_m128i(shuf_g, shuf_g);
+                const __m256i shuf_r2 = _mm256_setr_m128i(shuf_r, shuf_r);
+                const __m256i limit2 = _mm256_set1_epi32(limit - 1);
+                const __m256i flip2 = _mm256_set1_epi32(invert ? -1 : 0);
+
+                // Loads are 16 bytes for 12 bytes of pixels; stop early
+                // enough never to read past the row
+                for (; i + 10 <= n; i += 8) {
+                        __m256i v = _mm256_setr_m128i(
+                                _mm_loadu_si128((const __m128i*) (p + i * 3)),
+                                _mm_loadu_si128((const __m128i*) (p + i * 3 + 12)));
+                        __m256i sum = _mm256_add_epi32(
+                                _mm256_add_epi32(channel(_mm256_shuffle_epi8(v, shuf_b2), 0),
+                                                 channel(_mm256_shuffle_epi8(v, shuf_g2), 1)),
+                                channel(_mm256_shuffle_epi8(v, shuf_r2), 2));
+                        __m256i set = _mm256_xor_si256(_mm256_cmpgt_epi32(sum, limit2), flip2);
+
+                        // 8 x 32 bit masks to 8 bytes, 4 per 128 bit lane
+                        set = _mm256_packs_epi16(_mm256_packs_epi32(set, set), set);
+                        uint32_t lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(set));
+                        uint32_t hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(set, 1));
+                        memcpy(out + i, &lo, 4);
+                        memcpy(out + i + 4, &hi, 4);
+                }
+#endif
+                const __m128i limit1 = _mm_set1_epi32(limit - 1);
+                const __m128i flip1 = _mm_set1_epi32(invert ? -1 : 0);
+
+                for (; i + 6 <= n; i += 4) {
+                        __m128i v = _mm_loadu_si128((const __m128i*) (p + i * 3));
+                        __m128i sum = _mm_add_epi32(
+                                _mm_add_epi32(channel(_mm_shuffle_epi8(v, shuf_b), 0),
+                                              channel(_mm_shuffle_epi8(v, shuf_g), 1)),
+                                channel(_mm_shuffle_epi8(v, shuf_r), 2));
+                        __m128i set = _mm_xor_si128(_mm_cmpgt_epi32(sum, limit1), flip1);
+
+                        set = _mm_packs_epi16(_mm_packs_epi32(set, set), set);
+                        uint32_t bytes = _mm_cvtsi128_si32(set);
+                        memcpy(out + i, &bytes, 4);
+                }
+#endif
+                for (; i < n; i++) {
+                        const uchar* q = p + i * 3;
+                        int sum = lut[0][q[0]] + lut[1][q[1]] + lut[2][q[2]];
+                        out[i] = sum >= limit ? on : 255 - on;
+                }
+        }
+
+#if defined(__SSE4_1__)
+        /**
+         * Weighted contribution of one channel, from its bytes in 32 bit
+         * lanes.  cvtps rounds to nearest even under the default MXCSR.
+         */
+        __m128i channel(__m128i v, int c) const
+        {
+                __m128i g = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(gain[c])));
+
+                g = _mm_min_epi32(_mm_max_epi32(g, _mm_setzero_si128()), _mm_set1_epi32(255));
+                g = _mm_mullo_epi32(g, _mm_set1_epi32(weight[c]));
+
+                return c == 2 ? _mm_add_epi32(g, _mm_set1_epi32(1 << 13)) : g;
+        }
+#endif
+#if defined(__AVX2__)
+        __m256i channel(__m256i v, int c) const
+        {
+                __m256i g = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v),
+                                                             _mm256_set1_ps(gain[c])));
+
+                g = _mm256_min_epi32(_mm256_max_epi32(g, _mm256_setzero_si256()),
+                                     _mm256_set1_epi32(255));
+                g = _mm256_mullo_epi32(g, _mm256_set1_epi32(weight[c]));
+
+                return c == 2 ? _mm256_add_epi32(g, _mm256_set1_epi32(1 << 13)) : g;
+        }
+#endif
+
+        float   gain[3];
+        int     weight[3];
+        int     lut[3][256];
+        int     limit;
+        bool    invert;
+};
+
+#endif
@@ -8,38 +8,11 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include "geometry.hpp"
+
 using namespace cv;
 using namespace std;
 
-/**
- * Find the acute angle of the major axes of two RotatedRects
- */
-static float rotatedRectsMajorAxisDelta(const RotatedRect& r1, const RotatedRect& r2)
-{
-        Point2f verts[4];
-        Point2f axis1, axis2;
-        vector<float> x, y, mag, ng;
-        float ng1, ng2;
-
-        r1.points(verts);
-        axis1 = verts[1] - verts[0];
-        axis2 = verts[3] - verts[0];
-        x = { axis1.x, axis2.x };
-        y = { axis1.y, axis2.y };
-        cartToPolar(x, y, mag, ng);
-        ng1 = ng[mag[0] > mag[1] ? 0 : 1] - M_PI;
-
-        r2.points(verts);
-        axis1 = verts[1] - verts[0];
-        axis2 = verts[3] - verts[0];
-        x = { axis1.x, axis2.x };
-        y = { axis1.y, axis2.y };
-        cartToPolar(x, y, mag, ng);
-        ng2 = ng[mag[0] > mag[1] ? 0 : 1] - M_PI;
- 
-        return abs(atan2(sin(ng1 - ng2), cos(ng1 - ng2)));
-}
-
 int main()
 {
         const char* vertlabels[] = { "0", "1", "2", "3" };
@@ -94,7 +67,7 @@ int main()
                 cout << endl;
                 */
 
-                cout << rotatedRectsMajorAxisDelta(rect1, rect2) << endl;
+                cout << rr_major_axis_delta(rect1, rect2) << endl;
 
                 while(true) {
                         int key = waitKey(1);
@@ -0,0 +1,73 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef SHAPE_TEMPLATE_HPP
+#define SHAPE_TEMPLATE_HPP
+
+#include <cmath>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+/**
+ * A contour to compare other contours against with matchShapes(), with the
+ * template's Hu moments worked out once instead of on every comparison.
+ *
+ * The moments are computed when the object is constructed; for the
+ * constant point tables that means once at startup.  (They cannot be
+ * constexpr in C++11: the Hu invariants need fractional powers and the
+ * comparison a log10.)
+ */
+class shape_template_t {
+public:
+        explicit shape_template_t(const std::vector<cv::Point>& contour)
+                : points(contour)
+        {
+                double hu[7];
+
+                cv::HuMoments(cv::moments(contour), hu);
+
+                for (int i = 0; i < 7; i++) {
+                        usable[i] = fabs(hu[i]) > EPS;
+                        log_hu[i] = usable[i] ? signed_log(hu[i]) : 0;
+                }
+        }
+
+        /**
+         * Same result as matchShapes(points, contour, CV_CONTOURS_MATCH_I3, 0):
+         * the largest relative difference of the signed log Hu moments.
+         */
+        double match_i3(const std::vector<cv::Point>& contour) const
+        {
+                double hu[7], result = 0;
+
+                cv::HuMoments(cv::moments(contour), hu);
+
+                for (int i = 0; i < 7; i++) {
+                        if (!usable[i] || !(fabs(hu[i]) > EPS))
+                                continue;
+
+                        double d = fabs((log_hu[i] - signed_log(hu[i])) / log_hu[i]);
+
+                        if (result < d)
+                                result = d;
+                }
+
+                return result;
+        }
+
+        const std::vector<cv::Point> points;
+
+private:
+        static constexpr double EPS = 1.e-5;
+
+        static double signed_log(double v)
+        {
+                return (v > 0 ? 1 : -1) * log10(fabs(v));
+        }
+
+        double log_hu[7];
+        bool   usable[7];
+};
+
+#endif
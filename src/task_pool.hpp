@@ -0,0 +1,210 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef TASK_POOL_HPP
+#define TASK_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Reusable barrier for a fixed set of threads that advance in lock step.
+ */
+class barrier_t {
+public:
+        explicit barrier_t(unsigned nthreads)
+                : n(nthreads), waiting(0), generation(0)
+        {
+        }
+
+        /**
+         * Block until all n threads have called wait() for this round.
+         */
+        void wait()
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                unsigned gen = generation;
+
+                if (++waiting == n) {
+                        waiting = 0;
+                        generation++;
+                        done.notify_all();
+                        return;
+                }
+
+                done.wait(lock, [this, gen] { return generation != gen; });
+        }
+
+private:
+        const unsigned          n;
+        std::mutex              mutex;
+        std::condition_variable done;
+        unsigned                waiting;
+        unsigned                generation;
+};
+
+/**
+ * A set of tasks submitted together and waited on together.
+ */
+struct task_group_t {
+        std::atomic<unsigned> pending;
+
+        task_group_t() : pending(0) {}
+};
+
+/**
+ * Small work-stealing thread pool for running a handful of independent
+ * jobs per frame.
+ *
+ * Every thread, including the one that submits, has its own queue.  Tasks
+ * are dealt round-robin over the queues; a thread takes the newest task of
+ * its own queue and, when that is empty, steals the oldest task of another.
+ * wait() does not block while tasks of the group are still queued: the
+ * caller runs them itself, so a pool of n workers keeps n + 1 cores busy
+ * and a pool of 0 workers simply runs everything on the caller.
+ *
+ * Tasks must not throw.
+ */
+class task_pool_t {
+public:
+        explicit task_pool_t(unsigned nworkers)
+                : queues(nworkers + 1), next(0), queued(0), stop(false)
+        {
+                for (auto& q : queues)
+                        q.reset(new queue_t);
+
+                for (unsigned i = 1; i <= nworkers; i++)
+                        workers.push_back(std::thread(&task_pool_t::work, this, i));
+        }
+
+        ~task_pool_t()
+        {
+                {
+                        std::lock_guard<std::mutex> lock(sleep_mutex);
+                        stop = true;
+                }
+                wake.notify_all();
+
+                for (auto& t : workers)
+                        t.join();
+        }
+
+        /**
+         * Threads that run tasks, counting the caller of wait().
+         */
+        unsigned size() const { return queues.size(); }
+
+        void submit(task_group_t& group, std::function<void()> fn)
+        {
+                group.pending.fetch_add(1, std::memory_order_relaxed);
+
+                queue_t& q = *queues[next++ % queues.size()];
+                {
+                        std::lock_guard<std::mutex> lock(q.mutex);
+                        q.tasks.push_back(task_t { std::move(fn), &group });
+                }
+
+                {
+                        std::lock_guard<std::mutex> lock(sleep_mutex);
+                        queued++;
+                }
+                wake.notify_one();
+        }
+
+        /**
+         * Run queued tasks until every task of the group has finished.
+         */
+        void wait(task_group_t& group)
+        {
+                while (group.pending.load(std::memory_order_acquire) != 0) {
+                        if (!run_one(0))
+                                std::this_thread::yield();
+                }
+        }
+
+private:
+        struct task_t {
+                std::function<void()> fn;
+                task_group_t*         group;
+        };
+
+        struct queue_t {
+                std::mutex          mutex;
+                std::deque<task_t>  tasks;
+        };
+
+        bool pop(unsigned i, task_t& task, bool own)
+        {
+                queue_t& q = *queues[i];
+                std::lock_guard<std::mutex> lock(q.mutex);
+
+                if (q.tasks.empty())
+                        return false;
+
+                if (own) {
+                        task = std::move(q.tasks.back());
+                        q.tasks.pop_back();
+                }
+                else {
+                        task = std::move(q.tasks.front());
+                        q.tasks.pop_front();
+                }
+
+                return true;
+        }
+
+        /**
+         * Run one task from queue self, or stolen from another queue.
+         */
+        bool run_one(unsigned self)
+        {
+                task_t task;
+                bool found = pop(self, task, true);
+
+                for (unsigned k = 1; !found && k < queues.size(); k++)
+                        found = pop((self + k) % queues.size(), task, false);
+
+                if (!found)
+                        return false;
+
+                {
+                        std::lock_guard<std::mutex> lock(sleep_mutex);
+                        queued--;
+                }
+
+                task.fn();
+                task.group->pending.fetch_sub(1, std::memory_order_release);
+
+                return true;
+        }
+
+        void work(unsigned self)
+        {
+                for (;;) {
+                        if (run_one(self))
+                                continue;
+
+                        std::unique_lock<std::mutex> lock(sleep_mutex);
+                        wake.wait(lock, [this] { return stop || queued > 0; });
+
+                        if (stop)
+                                return;
+                }
+        }
+
+        std::vector<std::unique_ptr<queue_t>> queues;
+        std::vector<std::thread>              workers;
+        unsigned                              next;     // submitting thread only
+
+        std::mutex                            sleep_mutex;
+        std::condition_variable               wake;
+        unsigned                              queued;   // guarded by sleep_mutex
+        bool                                  stop;     // guarded by sleep_mutex
+};
+
+#endif
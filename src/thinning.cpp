@@ -4,9 +4,22 @@
  * Author:  Nash (nash [at] opencv-code [dot] com) 
  * Website: http://opencv-code.com
  */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
+#include "task_pool.hpp"
+
 /**
  * Perform one thinning iteration.
  * Normally you wouldn't call this function directly from your code.
@@ -116,15 +129,356 @@ void thinning(const cv::Mat& src, cv::Mat& dst)
     dst *= 255;
 }
 
+/**
+ * Zhang-Suen deletion decisions for both sub-iterations, indexed by the
+ * 8-bit code of a pixel's neighborhood.  Bit i of the code is neighbor
+ * P(i+2) of the usual numbering, clockwise from north:
+ *
+ *      P9 P2 P3        bit 7  bit 0  bit 1
+ *      P8 P1 P4        bit 6    .    bit 2
+ *      P7 P6 P5        bit 5  bit 4  bit 3
+ */
+struct ThinningLut
+{
+    uchar del[2][256];
+
+    ThinningLut()
+    {
+        for (int iter = 0; iter < 2; iter++) {
+            for (int code = 0; code < 256; code++) {
+                int p[8];
+                for (int i = 0; i < 8; i++)
+                    p[i] = (code >> i) & 1;
+
+                int no = p[0], ne = p[1], ea = p[2], se = p[3];
+                int so = p[4], sw = p[5], we = p[6], nw = p[7];
+
+                int A  = (no == 0 && ne == 1) + (ne == 0 && ea == 1) +
+                         (ea == 0 && se == 1) + (se == 0 && so == 1) +
+                         (so == 0 && sw == 1) + (sw == 0 && we == 1) +
+                         (we == 0 && nw == 1) + (nw == 0 && no == 1);
+                int B  = no + ne + ea + se + so + sw + we + nw;
+                int m1 = iter == 0 ? (no * ea * so) : (no * ea * we);
+                int m2 = iter == 0 ? (ea * so * we) : (no * so * we);
+
+                del[iter][code] = A == 1 && (B >= 2 && B <= 6) && m1 == 0 && m2 == 0;
+            }
+        }
+    }
+};
+
+static const ThinningLut thinningTables;
+
+/**
+ * Neighborhood code of pixel x, given the rows above, at and below it.
+ */
+static inline int neighborhoodCode(const uchar* a, const uchar* c, const uchar* b, int x)
+{
+    return a[x] | a[x+1] << 1 | c[x+1] << 2 | b[x+1] << 3 |
+           b[x] << 4 | b[x-1] << 5 | c[x-1] << 6 | a[x-1] << 7;
+}
+
+/**
+ * One sub-iteration over rows [y0, y1) of a [0,1] image, in place.
+ *
+ * Every decision must see the image as it was before the sub-iteration.
+ * Rows are done top to bottom, so the row below is still untouched; the
+ * current row and the one above are read from copies taken before they
+ * were modified, two scanline buffers that swap roles every row.  above0
+ * and below1 are the pre-iteration content of rows y0 - 1 and y1.
+ *
+ * Returns the number of pixels deleted.
+ */
+static int thinningRowsLut(cv::Mat& img, int iter, int y0, int y1,
+                           const uchar* above0, const uchar* below1,
+                           uchar* buf0, uchar* buf1)
+{
+    const uchar* del = thinningTables.del[iter];
+    const int cols = img.cols;
+    uchar* const bufs[2] = { buf0, buf1 };
+    const uchar* above = above0;
+    int deleted = 0;
+
+    for (int y = y0; y < y1; ++y) {
+        uchar* row = img.ptr<uchar>(y);
+        uchar* curr = bufs[y & 1];
+        const uchar* below = y+1 == y1 ? below1 : img.ptr<uchar>(y+1);
+
+        memcpy(curr, row, cols);
+
+        for (int x = 1; x < cols-1; ++x) {
+            if (curr[x] && del[neighborhoodCode(above, curr, below, x)]) {
+                row[x] = 0;
+                deleted++;
+            }
+        }
+
+        // this row's copy is the next row's "above"
+        above = curr;
+    }
+
+    return deleted;
+}
+
+/**
+ * Zhang-Suen thinning with table lookups and in-place deletion.  Gives
+ * the same result as thinning(), with no allocation per iteration.
+ */
+void thinningLut(const cv::Mat& src, cv::Mat& dst)
+{
+    CV_Assert(src.type() == CV_8UC1);
+    CV_Assert(src.rows > 3 && src.cols > 3);
+
+    dst = src.clone();
+    dst /= 255;         // convert to binary image
+
+    std::vector<uchar> buf(dst.cols * 3);
+    int deleted;
+
+    do {
+        deleted = 0;
+        for (int iter = 0; iter < 2; iter++) {
+            memcpy(&buf[0], dst.ptr<uchar>(0), dst.cols);
+            deleted += thinningRowsLut(dst, iter, 1, dst.rows-1, &buf[0],
+                                       dst.ptr<uchar>(dst.rows-1),
+                                       &buf[dst.cols], &buf[2 * dst.cols]);
+        }
+    }
+    while (deleted > 0);
+
+    dst *= 255;
+}
+
+/**
+ * Zhang-Suen thinning that only looks at pixels whose neighborhood may
+ * have changed, with the same result as thinning().
+ *
+ * A pixel needs to be tested in a sub-iteration only if it has not been
+ * tested in a sub-iteration of the same parity since one of its neighbors
+ * was deleted; the two parities use different tables, so each has its own
+ * queue.  Both start with the foreground pixels next to the background (a
+ * pixel with eight foreground neighbors can never be deleted), and every
+ * deletion queues the deleted pixel's foreground neighbors for both
+ * parities.  A sub-iteration decides for its whole queue first and deletes
+ * afterwards, as the full scan does.  The image is final when both queues
+ * are empty, which is exactly when a full scan pair would delete nothing.
+ */
+void thinningWorklist(const cv::Mat& src, cv::Mat& dst)
+{
+    CV_Assert(src.type() == CV_8UC1);
+    CV_Assert(src.rows > 3 && src.cols > 3);
+
+    dst = src.clone();
+    dst /= 255;         // convert to binary image
+
+    const int cols = dst.cols;
+    const int step = dst.step;
+    uchar* data = dst.ptr<uchar>(0);
+
+    // bit p set: the pixel is on queue p
+    std::vector<uchar> queued(dst.rows * step, 0);
+    std::vector<int> queue[2], deleted;
+
+    for (int y = 1; y < dst.rows-1; ++y) {
+        const uchar* a = dst.ptr<uchar>(y-1);
+        const uchar* c = dst.ptr<uchar>(y);
+        const uchar* b = dst.ptr<uchar>(y+1);
+
+        for (int x = 1; x < cols-1; ++x) {
+            if (c[x] && neighborhoodCode(a, c, b, x) != 0xff) {
+                queue[0].push_back(y * step + x);
+                queue[1].push_back(y * step + x);
+                queued[y * step + x] = 3;
+            }
+        }
+    }
+
+    for (int iter = 0; !queue[0].empty() || !queue[1].empty(); iter ^= 1) {
+        const uchar* del = thinningTables.del[iter];
+
+        deleted.clear();
+
+        for (int i : queue[iter]) {
+            const uchar* c = data + i;
+
+            queued[i] &= ~(1 << iter);
+
+            if (*c && del[neighborhoodCode(c - step, c, c + step, 0)])
+                deleted.push_back(i);
+        }
+
+        queue[iter].clear();
+
+        for (int i : deleted)
+            data[i] = 0;
+
+        for (int i : deleted) {
+            const int y = i / step;
+            const int around[8] = {
+                i - step - 1, i - step, i - step + 1, i - 1,
+                i + 1, i + step - 1, i + step, i + step + 1
+            };
+
+            for (int k = 0; k < 8; k++) {
+                const int j = around[k];
+                const int jy = y + (k < 3 ? -1 : k < 5 ? 0 : 1);
+                const int jx = j - jy * step;
+
+                if (jy < 1 || jy >= dst.rows-1 || jx < 1 || jx >= cols-1 || !data[j])
+                    continue;
+
+                for (int p = 0; p < 2; p++) {
+                    if (!(queued[j] & (1 << p))) {
+                        queued[j] |= 1 << p;
+                        queue[p].push_back(j);
+                    }
+                }
+            }
+        }
+    }
+
+    dst *= 255;
+}
+
+/**
+ * thinningLut() on nthreads threads, each owning a horizontal stripe.
+ *
+ * Within a sub-iteration a stripe reads the last row of the stripe above
+ * and the first row of the stripe below, which their owners are changing
+ * at the same time, so each stripe works from halo copies of those two
+ * rows taken between two barriers: one after the previous sub-iteration's
+ * deletions and one before this sub-iteration's.  Every decision sees the
+ * pre-iteration state, as in the serial scan, so the result is identical.
+ * Whether anything was deleted in a pass pair is a shared flag, read by
+ * every thread after a barrier so they all stop after the same pair.
+ */
+void thinningParallel(const cv::Mat& src, cv::Mat& dst, unsigned nthreads)
+{
+    CV_Assert(src.type() == CV_8UC1);
+    CV_Assert(src.rows > 3 && src.cols > 3);
+
+    dst = src.clone();
+    dst /= 255;         // convert to binary image
+
+    const int inner = dst.rows - 2;
+    const int nstripes = std::max(1, std::min<int>(nthreads, inner));
+    const int cols = dst.cols;
+
+    barrier_t barrier(nstripes);
+    std::atomic<bool> changed[2];
+    changed[0] = changed[1] = false;
+
+    auto stripe = [&](int s) {
+        const int y0 = 1 + inner * s / nstripes;
+        const int y1 = 1 + inner * (s + 1) / nstripes;
+        std::vector<uchar> buf(cols * 4);
+        uchar* above0 = &buf[0];
+        uchar* below1 = &buf[cols];
+
+        for (unsigned pair = 0; ; pair++) {
+            for (int iter = 0; iter < 2; iter++) {
+                barrier.wait();
+                memcpy(above0, dst.ptr<uchar>(y0-1), cols);
+                memcpy(below1, dst.ptr<uchar>(y1), cols);
+                barrier.wait();
+
+                if (thinningRowsLut(dst, iter, y0, y1, above0, below1,
+                                    &buf[2 * cols], &buf[3 * cols]) > 0)
+                    changed[pair & 1].store(true, std::memory_order_relaxed);
+            }
+
+            barrier.wait();
+
+            if (!changed[pair & 1].load(std::memory_order_relaxed))
+                break;
+
+            // nobody touches the other flag until the next pair's passes
+            if (s == 0)
+                changed[(pair + 1) & 1].store(false, std::memory_order_relaxed);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int s = 1; s < nstripes; s++)
+        threads.push_back(std::thread(stripe, s));
+
+    stripe(0);
+
+    for (auto& t : threads)
+        t.join();
+
+    dst *= 255;
+}
+
+static double nowMs()
+{
+    struct timespec ts = {};
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--mode m] [--threads n] [--check] [--no-display] image\n", prog);
+    fprintf(stderr, "  --mode m      thinning implementation: reference lut worklist"
+                    " parallel (default: lut)\n");
+    fprintf(stderr, "  --threads n   threads for the parallel mode (default: all cores)\n");
+    fprintf(stderr, "  --check       also run the reference and compare the results\n");
+    fprintf(stderr, "  --no-display  print the timings only\n");
+}
+
 /**
  * This is an example on how to call the thinning funciton above
  */
 int main(int argc, char** argv)
 {
-    if (argc < 2)
+    const char* fname = NULL;
+    const char* mode = "lut";
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool check = false;
+    bool display = true;
+
+    const struct {
+        const char* name;
+        std::function<void (const cv::Mat&, cv::Mat&)> fn;
+    } modes[] = {
+        { "reference", thinning         },
+        { "lut",       thinningLut      },
+        { "worklist",  thinningWorklist },
+        { "parallel",  [&threads](const cv::Mat& src, cv::Mat& dst) {
+                           thinningParallel(src, dst, threads);
+                       } },
+    };
+    std::function<void (const cv::Mat&, cv::Mat&)> fn;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--mode") && i + 1 < argc)
+            mode = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--check"))
+            check = true;
+        else if (!strcmp(argv[i], "--no-display"))
+            display = false;
+        else if (argv[i][0] != '-' && fname == NULL)
+            fname = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (const auto& m : modes) {
+        if (mode == std::string(m.name))
+            fn = m.fn;
+    }
+
+    if (fname == NULL || !fn) {
+        usage(argv[0]);
         return 1;
+    }
 
-	cv::Mat src = cv::imread(argv[1]);
+	cv::Mat src = cv::imread(fname);
 	if (!src.data)
 		return -1;
 
@@ -137,11 +491,35 @@ int main(int argc, char** argv)
 	cv::cvtColor(blur1, bw, CV_BGR2GRAY);
 	cv::threshold(bw, bw, 50, 255, CV_THRESH_BINARY_INV);
 
-	thinning(bw, bw);
+    cv::Mat skel;
+    double t0 = nowMs();
+    fn(bw, skel);
+    double ms = nowMs() - t0;
+
+    printf("%s: %dx%d in %.1f ms\n", mode, bw.cols, bw.rows, ms);
+
+    if (check) {
+        cv::Mat ref, diff;
+
+        t0 = nowMs();
+        thinning(bw, ref);
+        double refMs = nowMs() - t0;
+
+        cv::compare(skel, ref, diff, cv::CMP_NE);
+        int mismatches = cv::countNonZero(diff);
+
+        printf("reference: %.1f ms, speedup %.2fx, %d mismatched pixels\n",
+               refMs, ms > 0 ? refMs / ms : 0, mismatches);
+
+        if (mismatches)
+            return 2;
+    }
+
+    if (display) {
+        cv::imshow("src", src);
+        cv::imshow("dst", skel);
+        cv::waitKey();
+    }
 
-	cv::imshow("src", src);
-	cv::imshow("dst", bw);
-	cv::waitKey();
 	return 0;
 }
-
@@ -0,0 +1,156 @@
+/* vim: set ts=8 sw=8 et : */
+
+#ifndef THRESHOLD_SWEEP_HPP
+#define THRESHOLD_SWEEP_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "incremental_canny.hpp"
+#include "task_pool.hpp"
+
+/*
+ * Evaluate Canny over a range of low thresholds (high = ratio * low) and
+ * pick one automatically.
+ *
+ * The gradients and local maxima come from an incremental_canny_t, so
+ * each threshold costs one hysteresis run and one findContours().  The
+ * thresholds are dealt to the pool threads in a stride, which spreads the
+ * expensive low thresholds evenly.
+ *
+ * The pick is the knee of the contour count: from its peak on, the point
+ * farthest below the chord to the last threshold, with both axes scaled
+ * to [0, 1].  Past the knee raising the threshold mostly removes real
+ * contours rather than noise.
+ */
+
+struct sweep_point_t {
+        int     low, high;
+        size_t  edge_pixels;
+        size_t  contours;
+        double  mean_length;            // arcLength() of the closed contours
+        double  median_length;
+        double  max_length;
+};
+
+static inline void sweep_point(const incremental_canny_t& canny, int low, double ratio,
+                canny_scratch_t& scratch, std::vector<int>& edges, cv::Mat& img,
+                sweep_point_t& out)
+{
+        const cv::Size size = canny.size();
+        std::vector<std::vector<cv::Point> > contours;
+        std::vector<double> lengths;
+
+        out = sweep_point_t();
+        out.low = low;
+        out.high = cvFloor(low * ratio);
+
+        canny.hysteresis(low, low * ratio, edges, scratch);
+        out.edge_pixels = edges.size();
+
+        img.create(size, CV_8UC1);
+        img = cv::Scalar::all(0);
+        for (size_t i = 0; i < edges.size(); i++)
+                img.ptr<uchar>(edges[i] / size.width)[edges[i] % size.width] = 255;
+
+        cv::findContours(img, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+        out.contours = contours.size();
+
+        if (contours.empty())
+                return;
+
+        for (size_t i = 0; i < contours.size(); i++)
+                lengths.push_back(cv::arcLength(contours[i], true));
+
+        std::sort(lengths.begin(), lengths.end());
+
+        for (size_t i = 0; i < lengths.size(); i++)
+                out.mean_length += lengths[i];
+        out.mean_length /= lengths.size();
+        out.median_length = lengths[lengths.size() / 2];
+        out.max_length = lengths.back();
+}
+
+/**
+ * One point per low threshold in [first, last].
+ */
+static inline void sweep_thresholds(const incremental_canny_t& canny, int first, int last,
+                double ratio, task_pool_t& pool, std::vector<sweep_point_t>& curve)
+{
+        const unsigned n = pool.size();
+        task_group_t group;
+
+        curve.assign(std::max(0, last - first + 1), sweep_point_t());
+
+        for (unsigned k = 0; k < n; k++) {
+                pool.submit(group, [&canny, &curve, first, ratio, n, k] {
+                        canny_scratch_t scratch;
+                        std::vector<int> edges;
+                        cv::Mat img;
+
+                        for (size_t i = k; i < curve.size(); i += n)
+                                sweep_point(canny, first + i, ratio, scratch, edges, img, curve[i]);
+                });
+        }
+
+        pool.wait(group);
+}
+
+/**
+ * Index into curve of the knee of the contour count.
+ */
+static inline size_t sweep_knee(const std::vector<sweep_point_t>& curve)
+{
+        if (curve.empty())
+                return 0;
+
+        size_t peak = 0, lowest = 0;
+
+        for (size_t i = 1; i < curve.size(); i++) {
+                if (curve[i].contours > curve[peak].contours)
+                        peak = i;
+                if (curve[i].contours < curve[lowest].contours)
+                        lowest = i;
+        }
+
+        const size_t last = curve.size() - 1;
+        const double range = (double) curve[peak].contours - curve[lowest].contours;
+
+        if (last - peak < 2 || range <= 0)
+                return peak;
+
+        const double y0 = 1, y1 = (curve[last].contours - (double) curve[lowest].contours) / range;
+        size_t knee = peak;
+        double best = 0;
+
+        for (size_t i = peak; i <= last; i++) {
+                double x = (double) (i - peak) / (last - peak);
+                double y = (curve[i].contours - (double) curve[lowest].contours) / range;
+                double below = y0 + (y1 - y0) * x - y;
+
+                if (below > best) {
+                        best = below;
+                        knee = i;
+                }
+        }
+
+        return knee;
+}
+
+static inline void write_sweep_csv(FILE* f, const std::vector<sweep_point_t>& curve)
+{
+        fprintf(f, "low,high,edge_pixels,contours,mean_length,median_length,max_length\n");
+
+        for (size_t i = 0; i < curve.size(); i++) {
+                const sweep_point_t& p = curve[i];
+
+                fprintf(f, "%d,%d,%zu,%zu,%.2f,%.2f,%.2f\n", p.low, p.high, p.edge_pixels,
+                        p.contours, p.mean_length, p.median_length, p.max_length);
+        }
+}
+
+#endif
@@ -7,6 +7,10 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
+#include "capture.hpp"
+#include "overlay.hpp"
+#include "preprocess.hpp"
+
 using namespace cv;
 
 const char* VIDEO_FILE = "../data/balance.m4v";
@@ -14,28 +18,37 @@ const char* WINDOW_NAME = "mainwindow";
 const Point SELECT_HALF_SIZE(125, 125);
 const unsigned SELECT_LINE_WIDTH = 5;
 const unsigned TEXT_LINE_PITCH = 16;
+const float GAIN_B = 2.0;
+const float GAIN_G = 3.0;
+const float GAIN_R = 2.0;
+const int BINARY_THRESHOLD = 75;
 
 static void onMouse(int, int, int, int, void*);
 
 int main(int argc, const char** argv)
 {
-    VideoCapture vc;
+    const char* input = argc > 1 ? argv[1] : VIDEO_FILE;
+    capture_t capture;
+    frame_t frame;
     std::vector<char> s(4096);
 
-    if (!vc.open(VIDEO_FILE)) {
-        CV_Error_(-1, ("failed to open video: \"%s\"", VIDEO_FILE));
+    if (!capture.open(input, true)) {
+        CV_Error_(-1, ("failed to open input: \"%s\"", input));
         std::exit(1);
     }
 
     int key = 0;
     bool pause = false;
     Point selection(-1000, -1000);
-    Mat pristine, dirty, dirty1, dirty2;
+    Mat& pristine = frame.image;
+    Mat dirty;
+    overlay_t overlay;
+    const gain_binarizer_t binarize(GAIN_B, GAIN_G, GAIN_R, BINARY_THRESHOLD, true);
 
     namedWindow(WINDOW_NAME, CV_WINDOW_NORMAL);
     resizeWindow(WINDOW_NAME,
-                 (int)vc.get(CV_CAP_PROP_FRAME_WIDTH),
-                 (int)vc.get(CV_CAP_PROP_FRAME_HEIGHT));
+                 capture.frame_size().width,
+                 capture.frame_size().height);
     setMouseCallback(WINDOW_NAME, onMouse, &selection);
 
     /*
@@ -65,10 +78,9 @@ int main(int argc, const char** argv)
         }
 
         if (!pause) {
-            if (! vc.read(pristine)) {
-                vc.set(CV_CAP_PROP_POS_FRAMES, 0U);
-                vc.read(pristine);
-            };
+            if (!capture.read(frame)) {
+                break;
+            }
         }
 
         //pristine.copyTo(dirty);
@@ -77,22 +89,8 @@ int main(int argc, const char** argv)
 
         //medianBlur(pristine, dirty1, 5);
 
-        vector<Mat> rgb;
-        split(pristine, rgb);
-        rgb[0] = rgb[0] * 2.0;
-        rgb[1] = rgb[1] * 3.0;
-        rgb[2] = rgb[2] * 2.0;
-        merge(&rgb[0], rgb.size(), dirty1);
-
-
-        cvtColor(dirty1, dirty2, CV_BGR2GRAY);
-        threshold(dirty2, dirty1, 75, 255, THRESH_BINARY);
-
-        Mat new_image = Mat::zeros(dirty1.size(), dirty1.type());
-        Mat sub_mat = Mat::ones(dirty1.size(), dirty1.type())*255;
-        subtract(sub_mat, dirty1, new_image);       
-
-        new_image.copyTo(dirty);
+        // Channel gains, gray, threshold and invert in one pass
+        binarize(pristine, dirty);
 
         /*
         keypoints.clear();
@@ -103,27 +101,28 @@ int main(int argc, const char** argv)
         std::cout << "keypoints.size()=" << keypoints.size() << std::endl;
         */
 
-        rectangle(dirty,
-                  selection - SELECT_HALF_SIZE,
-                  selection + SELECT_HALF_SIZE,
-                  Scalar(0,255,0), SELECT_LINE_WIDTH);
-
-        std::sprintf(&s[0], "CNT: %5u", (unsigned) vc.get(CV_CAP_PROP_FRAME_COUNT));
-        putText(dirty,
-                &s[0],
-                Point(vc.get(CV_CAP_PROP_FRAME_WIDTH)-200,TEXT_LINE_PITCH * 1),
-                FONT_HERSHEY_PLAIN,
-                1,
-                Scalar(255,255,255));
-
-        std::sprintf(&s[0], "F#:  %5u", (unsigned) vc.get(CV_CAP_PROP_POS_FRAMES));
-        putText(dirty,
-                &s[0],
-                Point(vc.get(CV_CAP_PROP_FRAME_WIDTH)-200,TEXT_LINE_PITCH * 2),
-                FONT_HERSHEY_PLAIN,
-                1,
-                Scalar(255,255,255));
+        overlay.clear();
+
+        overlay.rectangle(Rect(selection - SELECT_HALF_SIZE,
+                               selection + SELECT_HALF_SIZE),
+                          Scalar(0,255,0), SELECT_LINE_WIDTH);
+
+        std::sprintf(&s[0], "CNT: %5u", frame.count);
+        overlay.text(&s[0],
+                     Point(pristine.cols-200,TEXT_LINE_PITCH * 1),
+                     FONT_HERSHEY_PLAIN,
+                     1,
+                     Scalar(255,255,255));
+
+        std::sprintf(&s[0], "F#:  %5u", frame.num + 1);
+        overlay.text(&s[0],
+                     Point(pristine.cols-200,TEXT_LINE_PITCH * 2),
+                     FONT_HERSHEY_PLAIN,
+                     1,
+                     Scalar(255,255,255));
 
+        // dirty is rewritten every pass, so nothing to restore
+        overlay.composite(dirty);
         imshow(WINDOW_NAME, dirty);
 
         key = waitKey(1);
@@ -140,7 +139,7 @@ int main(int argc, const char** argv)
         }
     }
 
-    vc.release();
+    capture.close();
 
     return 0;
 }